@@ -56,6 +56,7 @@
 #include <string.h> // memcpy(), strcat(), strdup()
 #include <errno.h> // errno, EINVAL
 #include <arpa/inet.h> // inet_ntop()
+#include <sys/socket.h> // recv(), send(), accept()
 
 #define DNS_TYPE_ANY	0x00FF
 #define DNS_TYPE_A	0x0001	/* rfc 1035 */
@@ -70,9 +71,10 @@ static void dumphex(const char *label, const void *p, size_t len)
 }
 #endif
 
-static int llmnr_send_response(struct endpoint *ep, _saddr_t *sa,
+static int llmnr_send_response(struct endpoint *ep, int fd, const struct datagram *dg,
 				const uint8_t *in, size_t inlen)
 {
+	const _saddr_t *sa = &dg->from;
 	uint16_t qdcount, ancount, nscount;
 	uint16_t qtype, qclass;
 	char *in_name, *out = NULL;
@@ -85,7 +87,7 @@ static int llmnr_send_response(struct endpoint *ep, _saddr_t *sa,
 #ifdef NL_DEBUG
 	dumphex("LLMNR INPUT: ", in, inlen);
 #endif
-	if (connected_if(sa, &ci)) {
+	if (connected_if(ep, dg, &ci)) {
 		char buf[_ADDRSTRLEN];
 		DEBUG(1, L, "llmnr: connected_if: %s: %s",
 			inet_ntop(sa->ss.ss_family, _SIN_ADDR(sa), buf, sizeof buf),
@@ -231,17 +233,20 @@ static int llmnr_send_response(struct endpoint *ep, _saddr_t *sa,
 
 	/* check whether we are authorized to resolve this query */
 
+	const struct identity *id = identity_find(ep, dg, &ci);
+	const char *aliases[] = { id->hostaliases, id->netbiosaliases };
+
 	int found = 0;
-	if (!found && strlen(netbiosname) == in_name_len &&
-	    strncasecmp(netbiosname, in_name, in_name_len) == 0)
+	if (!found && strlen(id->netbiosname) == in_name_len &&
+	    strncasecmp(id->netbiosname, in_name, in_name_len) == 0)
 		found = 1;
 
-	if (!found && hostname && strlen(hostname) == in_name_len &&
-	    strncasecmp(hostname, in_name, in_name_len) == 0)
+	if (!found && id->hostname && strlen(id->hostname) == in_name_len &&
+	    strncasecmp(id->hostname, in_name, in_name_len) == 0)
 		found = 1;
 
-	for (const char **pp = &hostaliases; !found && pp != &netbiosaliases; pp = &netbiosaliases) {
-	        for (const char *pname = *pp; pname && *pname;) {
+	for (size_t i = 0; !found && i < ARRAY_SIZE(aliases); i++) {
+	        for (const char *pname = aliases[i]; pname && *pname;) {
 			const char *pend = strchr(pname, ' ');
 			size_t plen = pend ? (size_t) (pend - pname) : strlen(pname);
 			if (plen == in_name_len &&
@@ -375,7 +380,15 @@ send:
 #ifdef NL_DEBUG
 	dumphex("LLMNR OUTPUT: ", out, inlen + answer_len);
 #endif
-	ret = sendto(ep->sock, out, inlen + answer_len, 0, (struct sockaddr *)sa, slen);
+	if (ep->type == SOCK_STREAM) {
+		/* RFC 4795 2.4: TCP messages carry a two-octet length prefix. */
+		uint8_t pfx[2] = { (inlen + answer_len) >> 8, (inlen + answer_len) & 0xff };
+		ret = conn_send(ep->conn, pfx, sizeof pfx, MSG_MORE);
+		if (ret == (int) sizeof pfx)
+			ret = conn_send(ep->conn, out, inlen + answer_len, 0);
+	} else {
+		ret = sendto(fd, out, inlen + answer_len, 0, (struct sockaddr *)sa, slen);
+	}
 
 	free(out);
 	return ret;
@@ -387,20 +400,47 @@ int llmnr_init(struct endpoint *ep)
 	return 0;
 }
 
-int llmnr_recv(struct endpoint *ep)
+int llmnr_input(struct endpoint *ep, struct datagram *dg)
+{
+	((uint8_t *) dg->buf)[dg->len] = '\0';
+	llmnr_send_response(ep, ep->sock, dg, dg->buf, dg->len);
+	return dg->len;
+}
+
+/*
+ * LLMNR over TCP (RFC 4795 2.5): a two-octet length, then the message.
+ */
+int llmnr_serve(struct conn *c)
 {
-	uint8_t buf[9216+1]; // RFC 4795, Ethernet jumbo frame size
-	_saddr_t sa;
+	uint8_t *buf = (uint8_t *) c->buf;
 
-	socklen_t slen = sizeof sa;
-	ssize_t len = recvfrom(ep->sock, buf, sizeof(buf)-1, 0, (struct sockaddr *)&sa, &slen);
+	if (c->len < 2)
+		return 1;
 
-	if (len > 0) {
-		buf[len] = '\0';
-		llmnr_send_response(ep, &sa, buf, len);
+	size_t need = 2 + buf[0] * 256 + buf[1];
+	if (need > 2 + 9216) {
+		DEBUG(1, L, "llmnr: tcp: message too long (%zu)", need - 2);
+		return 0;
 	}
+	if (c->len < need)
+		return 1;
+
+	struct datagram dg = {
+		.from = c->from,
+		.to = c->to,
+	};
+
+	buf[need] = '\0';
+	llmnr_send_response(&c->ep, c->ep.sock, &dg, buf + 2, need - 2);
+	return 0;
+}
+
+int llmnr_recv(struct endpoint *ep)
+{
+	if (ep->type == SOCK_STREAM)
+		return accept_conn(ep);
 
-	return len;
+	return recv_batch(ep, 9216+1); // RFC 4795, Ethernet jumbo frame size
 }
 
 void llmnr_exit(struct endpoint *ep)
@@ -0,0 +1,985 @@
+/*
+   WSDD - Web Service Dynamic Discovery protocol server
+
+   Interface and address table maintained from rtnetlink.
+
+	Copyright (c) 2016 NETGEAR
+	Copyright (c) 2016 Hiro Sugawara
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each network namespace served has a struct netif_db. Its working table
+ * is seeded once with an RTM_GETLINK/RTM_GETADDR dump and then kept
+ * current by feeding it every message received on the namespace's
+ * netlink-v4v6 subscription. Only the control thread touches it. Each
+ * link there caches whether its addresses are to be used until a message
+ * changes its name, flags, kind or master.
+ *
+ * Everybody else sees immutable snapshots: netif_publish() copies the
+ * links and the addresses of usable links into a new struct netif_table
+ * and swaps it in with one atomic pointer store. Readers are the event
+ * loops; they use netif_get() without any lock, and call netif_offline()
+ * before they block and netif_online() when they wake up. A replaced
+ * snapshot goes on a retired list stamped with a new epoch and is freed
+ * once every online reader has come online again since then (QSBR).
+ *
+ * Reply address lookup goes through a per-family longest-prefix-match
+ * array built with each snapshot: the prefixes are grouped by length,
+ * longest first, and each group is sorted so that a lookup is one binary
+ * search per distinct prefix length.
+ */
+
+#include "wsdd.h"
+
+#include <stdlib.h> // realloc(), free(), qsort()
+#include <string.h> // memcmp(), memmove(), strncpy()
+#include <limits.h> // ULONG_MAX
+#include <errno.h> // errno
+#include <fnmatch.h> // fnmatch()
+#include <pthread.h> // pthread_mutex_lock()
+#include <stddef.h> // offsetof()
+#include <endian.h> // __BYTE_ORDER
+#include <arpa/inet.h> // htons(), htonl()
+#include <sys/socket.h> // socket(), send(), recv()
+#include <linux/filter.h> // struct sock_filter, BPF_STMT()
+#include <linux/rtnetlink.h> // RTM_NEWLINK, struct ifinfomsg, struct ifaddrmsg
+
+/* The link flags that matter to anybody; the others are not recorded. */
+#define LINK_FLAGS	(IFF_UP | IFF_RUNNING | IFF_LOOPBACK | IFF_POINTOPOINT | \
+			IFF_MULTICAST | IFF_SLAVE)
+
+struct netprefix {
+	uint8_t net[16];		/* na.addr masked to na.prefixlen */
+	struct netaddr na;
+};
+
+struct netlpm {
+	struct netprefix *pfx;
+	size_t npfx, cap;
+	struct {
+		unsigned char prefixlen;
+		size_t start, end;
+	} group[129];
+	size_t ngroups;
+};
+
+struct snapshot {
+	struct netif_table t;		/* first, what netif_get() hands out */
+	struct netlpm lpm[2];		/* AF_INET, AF_INET6 */
+	unsigned long retired;		/* epoch it was replaced in */
+	struct snapshot *next;		/* on the retired list */
+};
+
+/* The interfaces of one network namespace. */
+struct netif_db {
+	struct netif_table work;	/* control thread only */
+	struct snapshot *current;
+	struct snapshot *retired;	/* control thread only */
+	unsigned int seq;		/* of the last dump request */
+};
+
+static struct snapshot empty;
+static unsigned long epoch = 1;
+
+struct reader {
+	unsigned long epoch;		/* last seen online, 0 while offline */
+	struct reader *next;
+};
+
+static __thread struct reader self;
+static __thread bool registered;
+static struct reader *readers;
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *grow(void *p, size_t *cap, size_t n, size_t size)
+{
+	if (n < *cap)
+		return p;
+
+	size_t ncap = *cap ? *cap * 2 : 16;
+	void *np = realloc(p, ncap * size);
+
+	if (np)
+		*cap = ncap;
+	return np;
+}
+
+static struct netif *find_link(const struct netif_table *t, unsigned int index)
+{
+	for (size_t i = 0; i < t->nlinks; i++)
+		if (t->links[i].index == index)
+			return &t->links[i];
+	return NULL;
+}
+
+const struct netif *netif_find(const struct netif_table *t, unsigned int index)
+{
+	return find_link(t, index);
+}
+
+const struct netif *netif_find_name(const struct netif_table *t, const char *name)
+{
+	for (size_t i = 0; i < t->nlinks; i++)
+		if (strncmp(t->links[i].name, name, IFNAMSIZ) == 0)
+			return &t->links[i];
+	return NULL;
+}
+
+static void netif_del_addrs(struct netif_db *db, unsigned int index)
+{
+	size_t j = 0;
+
+	for (size_t i = 0; i < db->work.naddrs; i++)
+		if (db->work.addrs[i].index != index)
+			db->work.addrs[j++] = db->work.addrs[i];
+	db->work.naddrs = j;
+}
+
+static bool netif_link_msg(struct netif_db *db, const struct nlmsghdr *nh)
+{
+	const struct ifinfomsg *ifi = (const struct ifinfomsg *) NLMSG_DATA(nh);
+	struct rtattr *rta = IFLA_RTA(ifi);
+	size_t rtasize = IFLA_PAYLOAD(nh);
+	const char *name = NULL, *kind = NULL;
+	unsigned int master = 0;
+
+	/* Bridge port notifications reuse RTM_{NEW,DEL}LINK with AF_BRIDGE. */
+	if (ifi->ifi_family != AF_UNSPEC)
+		return false;
+
+	struct netif *ifp = find_link(&db->work, ifi->ifi_index);
+
+	if (nh->nlmsg_type == RTM_DELLINK) {
+		if (!ifp)
+			return false;
+		netif_del_addrs(db, ifp->index);
+		*ifp = db->work.links[--db->work.nlinks];
+		return true;
+	}
+
+	for (; RTA_OK(rta, rtasize); rta = RTA_NEXT(rta, rtasize)) {
+		switch (rta->rta_type) {
+		case IFLA_IFNAME:
+			name = (const char *) RTA_DATA(rta);
+			break;
+		case IFLA_MASTER:
+			master = *(const uint32_t *) RTA_DATA(rta);
+			break;
+		case IFLA_LINKINFO: {
+			struct rtattr *info = (struct rtattr *) RTA_DATA(rta);
+			size_t infosize = RTA_PAYLOAD(rta);
+
+			for (; RTA_OK(info, infosize); info = RTA_NEXT(info, infosize))
+				if (info->rta_type == IFLA_INFO_KIND)
+					kind = (const char *) RTA_DATA(info);
+			break;
+		}
+		}
+	}
+
+	if (!ifp) {
+		struct netif *links = grow(db->work.links, &db->work.links_cap,
+					db->work.nlinks, sizeof(*links));
+		if (!links) {
+			LOG(LOG_WARNING, "%s: %s", __func__, strerror(ENOMEM));
+			return false;
+		}
+		db->work.links = links;
+		ifp = &links[db->work.nlinks++];
+		memset(ifp, 0, sizeof(*ifp));
+		ifp->index = ifi->ifi_index;
+	} else if (ifp->flags == (ifi->ifi_flags & LINK_FLAGS) && ifp->master == master &&
+			(!name || strncmp(ifp->name, name, IFNAMSIZ) == 0) &&
+			strncmp(ifp->kind, kind ? kind : "", sizeof(ifp->kind)) == 0) {
+		return false; /* statistics, wireless events, ... */
+	}
+
+	ifp->flags = ifi->ifi_flags & LINK_FLAGS;
+	ifp->master = master;
+	if (name)
+		strncpy(ifp->name, name, IFNAMSIZ - 1);
+	memset(ifp->kind, 0, sizeof(ifp->kind));
+	if (kind)
+		strncpy(ifp->kind, kind, sizeof(ifp->kind) - 1);
+	ifp->verdict = NETIF_UNDECIDED;
+	return true;
+}
+
+static bool netif_addr_msg(struct netif_db *db, const struct nlmsghdr *nh)
+{
+	const struct ifaddrmsg *ifa = (const struct ifaddrmsg *) NLMSG_DATA(nh);
+	struct rtattr *rta = IFA_RTA(ifa);
+	size_t rtasize = IFA_PAYLOAD(nh);
+	const void *address = NULL, *local = NULL;
+	uint32_t flags = ifa->ifa_flags;
+	struct netaddr na = {
+		.index = ifa->ifa_index,
+		.family = ifa->ifa_family,
+		.prefixlen = ifa->ifa_prefixlen,
+	};
+	size_t alen;
+
+	switch (ifa->ifa_family) {
+	case AF_INET:
+		alen = sizeof(na.addr.in);
+		break;
+	case AF_INET6:
+		alen = sizeof(na.addr.in6);
+		break;
+	default:
+		return false;
+	}
+
+	for (; RTA_OK(rta, rtasize); rta = RTA_NEXT(rta, rtasize)) {
+		if (rta->rta_type == IFA_FLAGS && RTA_PAYLOAD(rta) >= sizeof(flags))
+			flags = *(const uint32_t *) RTA_DATA(rta); /* all 32 bits */
+		if (RTA_PAYLOAD(rta) < alen)
+			continue;
+		if (rta->rta_type == IFA_ADDRESS)
+			address = RTA_DATA(rta);
+		else if (rta->rta_type == IFA_LOCAL)
+			local = RTA_DATA(rta);
+	}
+
+	/* Same choice as getifaddrs(): IFA_ADDRESS is the peer on p-t-p links. */
+	if (local)
+		address = local;
+	if (!address)
+		return false;
+	memcpy(&na.addr, address, alen);
+
+	size_t i;
+	for (i = 0; i < db->work.naddrs; i++) {
+		const struct netaddr *a = &db->work.addrs[i];
+		if (a->index == na.index && a->family == na.family &&
+			a->prefixlen == na.prefixlen && memcmp(&a->addr, &na.addr, alen) == 0)
+			break;
+	}
+
+	/*
+	 * An address still in DAD, one that failed it, a privacy address or
+	 * one on its way out is neither bound nor used as a reply source; it
+	 * counts as gone until a later message reports it usable. Privacy
+	 * address rotation thus never shows up here at all.
+	 */
+	if (na.family == AF_INET6 && (flags & IFA_F_TEMPORARY))
+		return false; /* IFA_F_SECONDARY on IPv4 */
+	if (nh->nlmsg_type == RTM_DELADDR ||
+		flags & (IFA_F_TENTATIVE | IFA_F_DADFAILED | IFA_F_DEPRECATED)) {
+		if (i == db->work.naddrs)
+			return false;
+		memmove(&db->work.addrs[i], &db->work.addrs[i + 1],
+			(--db->work.naddrs - i) * sizeof(db->work.addrs[0]));
+		return true;
+	}
+
+	if (i < db->work.naddrs)
+		return false; /* lifetime refresh */
+
+	struct netaddr *addrs = grow(db->work.addrs, &db->work.addrs_cap,
+				db->work.naddrs, sizeof(*addrs));
+	if (!addrs) {
+		LOG(LOG_WARNING, "%s: %s", __func__, strerror(ENOMEM));
+		return false;
+	}
+	db->work.addrs = addrs;
+	addrs[db->work.naddrs++] = na;
+	return true;
+}
+
+static bool netif_apply(struct netif_db *db, const struct nlmsghdr *nh)
+{
+	switch (nh->nlmsg_type) {
+	case RTM_NEWLINK:
+	case RTM_DELLINK:
+		if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifinfomsg)))
+			return false;
+		return netif_link_msg(db, nh);
+	case RTM_NEWADDR:
+	case RTM_DELADDR:
+		if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifaddrmsg)))
+			return false;
+		return netif_addr_msg(db, nh);
+	default:
+		return false;
+	}
+}
+
+static size_t addrlen(int family)
+{
+	return family == AF_INET6 ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+}
+
+static void mask(uint8_t *net, const void *addr, size_t alen, unsigned int prefixlen)
+{
+	size_t n = prefixlen / 8;
+
+	memcpy(net, addr, alen);
+	if (n < alen) {
+		net[n] &= (uint8_t) (0xff00 >> (prefixlen % 8));
+		memset(net + n + 1, 0, alen - n - 1);
+	}
+}
+
+static int netprefix_cmp(const void *a, const void *b)
+{
+	const struct netprefix *p = a, *q = b;
+
+	if (p->na.prefixlen != q->na.prefixlen)
+		return q->na.prefixlen - p->na.prefixlen;
+
+	int rv = memcmp(p->net, q->net, addrlen(p->na.family));
+	if (rv)
+		return rv;
+	return (p->na.index > q->na.index) - (p->na.index < q->na.index);
+}
+
+/*
+ * Build the longest-prefix-match arrays of snapshot s from its addresses.
+ */
+static int lpm_build(struct snapshot *s)
+{
+	for (size_t i = 0; i < s->t.naddrs; i++) {
+		const struct netaddr *na = &s->t.addrs[i];
+		struct netlpm *t = &s->lpm[na->family == AF_INET6];
+		struct netprefix *pfx = grow(t->pfx, &t->cap, t->npfx, sizeof(*pfx));
+
+		if (!pfx)
+			return -1;
+		t->pfx = pfx;
+		pfx = &pfx[t->npfx++];
+		pfx->na = *na;
+		mask(pfx->net, &na->addr, addrlen(na->family), na->prefixlen);
+	}
+
+	for (size_t f = 0; f < ARRAY_SIZE(s->lpm); f++) {
+		struct netlpm *t = &s->lpm[f];
+
+		if (t->npfx)
+			qsort(t->pfx, t->npfx, sizeof(t->pfx[0]), netprefix_cmp);
+
+		t->ngroups = 0;
+		for (size_t i = 0; i < t->npfx; i++) {
+			if (!i || t->pfx[i].na.prefixlen != t->pfx[i - 1].na.prefixlen) {
+				t->group[t->ngroups].prefixlen = t->pfx[i].na.prefixlen;
+				t->group[t->ngroups++].start = i;
+			}
+			t->group[t->ngroups - 1].end = i + 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Find the most specific usable prefix in snapshot s containing addr,
+ * restricted to link index unless it is 0. Neither allocates nor enters
+ * the kernel.
+ */
+const struct netaddr *netif_lookup(const struct netif_table *s, int family,
+				const void *addr, unsigned int index)
+{
+	const struct netlpm *t = &((const struct snapshot *) s)->lpm[family == AF_INET6];
+	size_t alen = addrlen(family);
+	uint8_t key[16];
+
+	if (family != AF_INET && family != AF_INET6)
+		return NULL;
+
+	for (size_t g = 0; g < t->ngroups; g++) {
+		size_t lo = t->group[g].start, hi = t->group[g].end;
+
+		mask(key, addr, alen, t->group[g].prefixlen);
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (memcmp(t->pfx[mid].net, key, alen) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		for (; lo < t->group[g].end && !memcmp(t->pfx[lo].net, key, alen); lo++)
+			if (!index || t->pfx[lo].na.index == index)
+				return &t->pfx[lo].na;
+	}
+	return NULL;
+}
+
+/*
+ * Apply one rtnetlink message to the working table.
+ * Returns true if an interface or address was added, removed or changed.
+ */
+bool netif_update(struct netif_db *db, const struct nlmsghdr *nh)
+{
+	return netif_apply(db, nh);
+}
+
+static void snapshot_free(struct snapshot *s)
+{
+	if (s == &empty)
+		return;
+	free(s->t.links);
+	free(s->t.addrs);
+	for (size_t f = 0; f < ARRAY_SIZE(s->lpm); f++)
+		free(s->lpm[f].pfx);
+	free(s);
+}
+
+/*
+ * Copy the working table into a new snapshot, keeping only the addresses
+ * of links that usable() accepts. It is asked only about links that have
+ * changed since, along with their master link if that is known.
+ */
+static struct snapshot *snapshot_build(struct netif_db *db,
+		bool (*usable)(const struct netif *, const struct netif *))
+{
+	struct snapshot *s = (struct snapshot *) calloc(1, sizeof(*s));
+
+	if (!s)
+		goto fail;
+	s->t.links = (struct netif *) malloc((db->work.nlinks + 1) * sizeof(*s->t.links));
+	s->t.addrs = (struct netaddr *) malloc((db->work.naddrs + 1) * sizeof(*s->t.addrs));
+	if (!s->t.links || !s->t.addrs)
+		goto fail;
+
+	for (size_t i = 0; i < db->work.nlinks; i++) {
+		struct netif *ifp = &db->work.links[i];
+
+		if (ifp->verdict == NETIF_UNDECIDED)
+			ifp->verdict = usable(ifp, ifp->master ? find_link(&db->work, ifp->master) : NULL) ?
+				NETIF_USABLE : NETIF_UNUSABLE;
+	}
+	memcpy(s->t.links, db->work.links, db->work.nlinks * sizeof(*s->t.links));
+	s->t.nlinks = s->t.links_cap = db->work.nlinks;
+
+	for (size_t i = 0; i < db->work.naddrs; i++) {
+		const struct netif *ifp = find_link(&db->work, db->work.addrs[i].index);
+		if (ifp && ifp->verdict == NETIF_USABLE)
+			s->t.addrs[s->t.naddrs++] = db->work.addrs[i];
+	}
+	s->t.addrs_cap = s->t.naddrs;
+
+	if (lpm_build(s))
+		goto fail;
+	return s;
+
+fail:
+	if (s)
+		snapshot_free(s);
+	return NULL;
+}
+
+/*
+ * Make a snapshot of the working table current. The one it replaces is
+ * retired and freed by netif_reclaim() once no reader can hold it.
+ */
+int netif_publish(struct netif_db *db,
+		bool (*usable)(const struct netif *, const struct netif *))
+{
+	struct snapshot *s = snapshot_build(db, usable), *old;
+
+	if (!s) {
+		LOG(LOG_WARNING, "%s: %s", __func__, strerror(ENOMEM));
+		return -1;
+	}
+
+	old = __atomic_exchange_n(&db->current, s, __ATOMIC_SEQ_CST);
+	if (old != &empty) {
+		old->retired = __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+		old->next = db->retired;
+		db->retired = old;
+	}
+
+	DEBUG(2, W, "%s: %zu links, %zu of %zu addresses usable", __func__,
+		s->t.nlinks, s->t.naddrs, db->work.naddrs);
+	netif_reclaim(db);
+	return 0;
+}
+
+/*
+ * Free the retired snapshots that every reader has moved past.
+ * Returns the number of those still waiting.
+ */
+size_t netif_reclaim(struct netif_db *db)
+{
+	unsigned long oldest = ULONG_MAX;
+	size_t left = 0;
+
+	pthread_mutex_lock(&readers_lock);
+	for (struct reader *r = readers; r; r = r->next) {
+		unsigned long e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+		if (e && e < oldest)
+			oldest = e;
+	}
+	pthread_mutex_unlock(&readers_lock);
+
+	for (struct snapshot **sp = &db->retired; *sp;) {
+		struct snapshot *s = *sp;
+
+		if (s->retired <= oldest) {
+			*sp = s->next;
+			snapshot_free(s);
+		} else {
+			sp = &s->next;
+			left++;
+		}
+	}
+	return left;
+}
+
+/* The current snapshot; valid for the calling reader until it goes offline. */
+const struct netif_table *netif_get(const struct netif_db *db)
+{
+	return &__atomic_load_n(&db->current, __ATOMIC_SEQ_CST)->t;
+}
+
+/*
+ * Mark the calling thread as a reader that may hold snapshots from now
+ * on, registering it first if need be.
+ */
+void netif_online(void)
+{
+	if (!registered) {
+		pthread_mutex_lock(&readers_lock);
+		self.next = readers;
+		readers = &self;
+		pthread_mutex_unlock(&readers_lock);
+		registered = true;
+	}
+	__atomic_store_n(&self.epoch, __atomic_load_n(&epoch, __ATOMIC_SEQ_CST),
+		__ATOMIC_SEQ_CST);
+}
+
+/* The calling thread holds no snapshot any more, e.g. before it blocks. */
+void netif_offline(void)
+{
+	__atomic_store_n(&self.epoch, 0, __ATOMIC_SEQ_CST);
+}
+
+/* Stop being a reader; for threads about to exit. */
+void netif_detach(void)
+{
+	netif_offline();
+	if (!registered)
+		return;
+
+	pthread_mutex_lock(&readers_lock);
+	for (struct reader **rp = &readers; *rp; rp = &(*rp)->next) {
+		if (*rp == &self) {
+			*rp = self.next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&readers_lock);
+	registered = false;
+}
+
+static int netif_dump(struct netif_db *db, int fd, int type, unsigned int seq)
+{
+	struct {
+		struct nlmsghdr hdr;
+		struct rtgenmsg gen;
+	} req = {
+		{ sizeof(req), type, NLM_F_REQUEST | NLM_F_DUMP, seq, 0 },
+		{ AF_UNSPEC },
+	};
+	char buf[32 * 1024];
+
+	if (send(fd, &req, sizeof(req), 0) != sizeof(req))
+		return -1;
+
+	for (;;) {
+		ssize_t len = recv(fd, buf, sizeof(buf), 0);
+
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			return -1;
+
+		size_t msglen = len;
+		for (struct nlmsghdr *nh = (struct nlmsghdr *) buf;
+				NLMSG_OK(nh, msglen); nh = NLMSG_NEXT(nh, msglen)) {
+			if (nh->nlmsg_seq != seq)
+				continue;
+			if (nh->nlmsg_type == NLMSG_DONE)
+				return 0;
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				const struct nlmsgerr *e = (const struct nlmsgerr *) NLMSG_DATA(nh);
+				errno = e->error ? -e->error : EIO;
+				return -1;
+			}
+			netif_apply(db, nh);
+		}
+	}
+}
+
+/*
+ * Socket filter for the subscription, the kernel-side half of
+ * netif_apply(). It drops link messages of other families (bridge port
+ * notifications), flag changes confined to flags outside LINK_FLAGS,
+ * wireless events (just IFLA_IFNAME and IFLA_WIRELESS) and IPv6 privacy
+ * addresses, none of which would change the table. Loads are big-endian
+ * while netlink is host order, hence htons()/htonl() on the constants
+ * and LO, the offset of the low byte of a 16-bit field.
+ */
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define LO	0
+#else
+#define LO	1
+#endif
+
+int netif_filter(int fd)
+{
+	const unsigned int type = offsetof(struct nlmsghdr, nlmsg_type);
+	const unsigned int body = NLMSG_LENGTH(0);
+	const unsigned int attr = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	struct sock_filter code[] = {
+		/*  0 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, type),
+		/*  1 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(RTM_NEWADDR), 18, 0),
+		/*  2 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(RTM_DELADDR), 17, 0),
+		/*  3 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(RTM_NEWLINK), 1, 0),
+		/*  4 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(RTM_DELLINK), 0, 19),
+		/* link */
+		/*  5 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, body + offsetof(struct ifinfomsg, ifi_family)),
+		/*  6 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AF_UNSPEC, 0, 18),
+		/*  7 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, type),
+		/*  8 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(RTM_DELLINK), 15, 0),
+		/*  9 */ BPF_STMT(BPF_LD | BPF_W | BPF_ABS, body + offsetof(struct ifinfomsg, ifi_change)),
+		/* 10 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 0),
+		/* 11 */ BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, htonl(LINK_FLAGS), 12, 13),
+		/* no flag changed: a wireless event? */
+		/* 12 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, attr + offsetof(struct rtattr, rta_type)),
+		/* 13 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(IFLA_IFNAME), 0, 10),
+		/* 14 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, attr + offsetof(struct rtattr, rta_len) + LO),
+		/* 15 */ BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, RTA_ALIGNTO - 1),
+		/* 16 */ BPF_STMT(BPF_ALU | BPF_AND | BPF_K, ~(RTA_ALIGNTO - 1)),
+		/* 17 */ BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		/* 18 */ BPF_STMT(BPF_LD | BPF_B | BPF_IND, attr + offsetof(struct rtattr, rta_type) + LO),
+		/* 19 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IFLA_WIRELESS, 5, 4),
+		/* address */
+		/* 20 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, body + offsetof(struct ifaddrmsg, ifa_family)),
+		/* 21 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AF_INET6, 0, 2),
+		/* 22 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, body + offsetof(struct ifaddrmsg, ifa_flags)),
+		/* 23 */ BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, IFA_F_TEMPORARY, 1, 0),
+		/* 24 */ BPF_STMT(BPF_RET | BPF_K, 0xffffffff),	/* accept */
+		/* 25 */ BPF_STMT(BPF_RET | BPF_K, 0),		/* drop */
+	};
+	const struct sock_fprog prog = { .len = ARRAY_SIZE(code), .filter = code };
+
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+/*
+ * (Re)load the whole working table from the kernel over fd, an unbound
+ * NETLINK_ROUTE socket of the namespace; publish it next.
+ */
+int netif_load(struct netif_db *db, int fd)
+{
+	db->work.nlinks = db->work.naddrs = 0;
+
+	/* A fresh sequence number each, so leftovers of a failed dump are ignored. */
+	int rv = netif_dump(db, fd, RTM_GETLINK, ++db->seq);
+	if (!rv)
+		rv = netif_dump(db, fd, RTM_GETADDR, ++db->seq);
+
+	DEBUG(2, W, "%s: %zu links, %zu addresses", __func__, db->work.nlinks, db->work.naddrs);
+	return rv;
+}
+
+static bool same_link(const struct netif *a, const struct netif *b)
+{
+	return a->flags == b->flags && a->master == b->master &&
+		strncmp(a->name, b->name, sizeof(a->name)) == 0 &&
+		strncmp(a->kind, b->kind, sizeof(a->kind)) == 0;
+}
+
+static bool same_addr(const struct netaddr *a, const struct netaddr *b)
+{
+	return a->index == b->index && a->family == b->family &&
+		a->prefixlen == b->prefixlen &&
+		memcmp(&a->addr, &b->addr, addrlen(a->family)) == 0;
+}
+
+/*
+ * Reload the working table after netlink messages have been lost, and
+ * tell whether it differs from what they had made of it. Links that are
+ * unchanged keep their cached verdict. On failure the table is kept.
+ */
+int netif_resync(struct netif_db *db, int fd, bool *changed)
+{
+	struct netif_table old = db->work;
+
+	memset(&db->work, 0, sizeof(db->work));
+	if (netif_load(db, fd)) {
+		int _errno = errno;
+		free(db->work.links);
+		free(db->work.addrs);
+		db->work = old;
+		errno = _errno;
+		return -1;
+	}
+
+	*changed = db->work.nlinks != old.nlinks || db->work.naddrs != old.naddrs;
+	for (size_t i = 0; i < db->work.nlinks; i++) {
+		struct netif *ifp = &db->work.links[i];
+		const struct netif *was = find_link(&old, ifp->index);
+
+		if (was && same_link(ifp, was))
+			ifp->verdict = was->verdict;
+		else
+			*changed = true;
+	}
+	for (size_t i = 0; i < db->work.naddrs && !*changed; i++) {
+		size_t j;
+		for (j = 0; j < old.naddrs && !same_addr(&db->work.addrs[i], &old.addrs[j]); j++)
+			;
+		if (j == old.naddrs)
+			*changed = true;
+	}
+
+	free(old.links);
+	free(old.addrs);
+	DEBUG(1, W, "%s: interface table %s", __func__, *changed ? "changed" : "unchanged");
+	return 0;
+}
+
+/*
+ * Interface name rules: comma-separated shell globs, sorted once into
+ * exact names, plain "prefix*" patterns and full fnmatch() patterns so
+ * that the common cases need no pattern matching at all.
+ */
+int netif_match_add(struct netif_match *m, const char *list)
+{
+	char *copy = strdup(list), *save = NULL;
+
+	if (!copy)
+		return -1;
+
+	for (char *p = strtok_r(copy, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+		struct netif_pattern *pat;
+		size_t len = strcspn(p, "*?[\\");
+
+		pat = grow(m->pat, &m->cap, m->npat, sizeof(*pat));
+		if (!pat || !(pat[m->npat].glob = strdup(p))) {
+			free(copy);
+			return -1;
+		}
+		m->pat = pat;
+		pat = &pat[m->npat++];
+		pat->len = len;
+		if (!p[len])
+			pat->kind = NETIF_EXACT;
+		else if (p[len] == '*' && !p[len + 1])
+			pat->kind = NETIF_PREFIX;
+		else
+			pat->kind = NETIF_GLOB;
+	}
+
+	free(copy);
+	return 0;
+}
+
+bool netif_match(const struct netif_match *m, const char *name)
+{
+	for (size_t i = 0; i < m->npat; i++) {
+		const struct netif_pattern *pat = &m->pat[i];
+
+		switch (pat->kind) {
+		case NETIF_EXACT:
+			if (strcmp(name, pat->glob) == 0)
+				return true;
+			break;
+		case NETIF_PREFIX:
+			if (strncmp(name, pat->glob, pat->len) == 0)
+				return true;
+			break;
+		case NETIF_GLOB:
+			if (strncmp(name, pat->glob, pat->len) == 0 &&
+				fnmatch(pat->glob + pat->len, name + pat->len, 0) == 0)
+				return true;
+			break;
+		}
+	}
+	return false;
+}
+
+void netif_match_free(struct netif_match *m)
+{
+	for (size_t i = 0; i < m->npat; i++)
+		free(m->pat[i].glob);
+	free(m->pat);
+	memset(m, 0, sizeof(*m));
+}
+
+struct netif_db *netif_new(void)
+{
+	struct netif_db *db = (struct netif_db *) calloc(1, sizeof(*db));
+
+	if (db)
+		db->current = &empty;
+	return db;
+}
+
+/* Free db and all of its snapshots; no reader may be left. */
+void netif_free(struct netif_db *db)
+{
+	if (!db)
+		return;
+	free(db->work.links);
+	free(db->work.addrs);
+	snapshot_free(db->current);
+	while (db->retired) {
+		struct snapshot *s = db->retired;
+		db->retired = s->next;
+		snapshot_free(s);
+	}
+	free(db);
+}
+
+#ifdef MAIN
+
+// make netif_bench && ./netif_bench
+// Reply address lookup cost: LPM arrays vs. the old linear prefix scan.
+
+#include <stdio.h> // printf()
+#include <time.h> // clock_gettime()
+
+int debug_L, debug_W;
+bool is_daemon;
+
+#define LOOKUPS	1000000
+#define QUERIES	4096
+
+static bool prefix_match(const uint8_t *a, const uint8_t *b, unsigned int plen)
+{
+	size_t n = plen / 8;
+
+	if (memcmp(a, b, n) != 0)
+		return false;
+	if (plen % 8)
+		return ((a[n] ^ b[n]) & (0xff << (8 - plen % 8))) == 0;
+	return true;
+}
+
+static const struct netaddr *linear_lookup(const struct netif_table *t, int family,
+					const void *addr)
+{
+	for (size_t i = 0; i < t->naddrs; i++) {
+		const struct netaddr *na = &t->addrs[i];
+		if (na->family == family &&
+			prefix_match((const uint8_t *) &na->addr, addr, na->prefixlen))
+			return na;
+	}
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool all_usable(const struct netif *ifp, const struct netif *master)
+{
+	(void) ifp; (void) master; // silent "unused" warning
+	return true;
+}
+
+/* 10.x.y.1/24 and fd00:x:y::1/64 on 8 links, one in eight queries misses. */
+static const struct netif_table *fill(struct netif_db *db, size_t n)
+{
+	db->work.nlinks = db->work.naddrs = 0;
+	for (size_t i = 0; i < 8; i++) {
+		struct netif *ifp = grow(db->work.links, &db->work.links_cap,
+					db->work.nlinks, sizeof(*ifp));
+		if (!ifp)
+			exit(EXIT_FAILURE);
+		db->work.links = ifp;
+		ifp = &ifp[db->work.nlinks++];
+		memset(ifp, 0, sizeof(*ifp));
+		ifp->index = i + 1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		struct netaddr *na = grow(db->work.addrs, &db->work.addrs_cap,
+					db->work.naddrs, sizeof(*na));
+		if (!na)
+			exit(EXIT_FAILURE);
+		db->work.addrs = na;
+		na = &na[db->work.naddrs++];
+		memset(na, 0, sizeof(*na));
+		na->index = i % 8 + 1;
+		if (i % 2) {
+			na->family = AF_INET6;
+			na->prefixlen = 64;
+			na->addr.in6.s6_addr[0] = 0xfd;
+			na->addr.in6.s6_addr[3] = i >> 8;
+			na->addr.in6.s6_addr[5] = i;
+			na->addr.in6.s6_addr[15] = 1;
+		} else {
+			na->family = AF_INET;
+			na->prefixlen = 24;
+			na->addr.in.s_addr = htonl(0x0a000001 | (i << 8));
+		}
+	}
+	if (netif_publish(db, all_usable))
+		exit(EXIT_FAILURE);
+	return netif_get(db);
+}
+
+static void bench(struct netif_db *db, size_t n)
+{
+	static uint8_t q[QUERIES][16];
+	static int qf[QUERIES];
+	const size_t nq = ARRAY_SIZE(q);
+	size_t hits[2] = { 0 };
+	double t[3];
+
+	const struct netif_table *tab = fill(db, n);
+	for (size_t i = 0; i < nq; i++) {
+		const struct netaddr *na = &tab->addrs[random() % n];
+		qf[i] = na->family;
+		memcpy(q[i], &na->addr, sizeof(na->addr));
+		q[i][na->family == AF_INET ? 3 : 15] = 2 + random() % 200;
+		if (i % 8 == 0)
+			q[i][na->family == AF_INET ? 0 : 1] ^= 0x40;
+	}
+
+	t[0] = now();
+	for (size_t i = 0; i < LOOKUPS; i++)
+		hits[0] += !!netif_lookup(tab, qf[i % nq], q[i % nq], 0);
+	t[1] = now();
+	for (size_t i = 0; i < LOOKUPS; i++)
+		hits[1] += !!linear_lookup(tab, qf[i % nq], q[i % nq]);
+	t[2] = now();
+
+	printf("%5zu addresses: lpm %7.1f ns/lookup, linear %7.1f ns/lookup (hits %zu/%zu)\n",
+		n, (t[1] - t[0]) * 1e9 / LOOKUPS, (t[2] - t[1]) * 1e9 / LOOKUPS,
+		hits[0], hits[1]);
+}
+
+int main(void)
+{
+	struct netif_db *db = netif_new();
+
+	if (!db)
+		return EXIT_FAILURE;
+	bench(db, 10);
+	bench(db, 100);
+	bench(db, 1000);
+	netif_free(db);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,176 @@
+/*
+   WSDD - Web Service Dynamic Discovery protocol server
+
+   Timers driven by the event loop.
+
+	Copyright (c) 2016 NETGEAR
+	Copyright (c) 2016 Hiro Sugawara
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Armed timers live in a binary min-heap ordered by deadline. The event
+ * loop waits at most timer_timeout() milliseconds and then calls
+ * timer_run(), so nothing ever has to sleep. struct timer is embedded in
+ * its owner, and each one records its heap slot, which keeps arming and
+ * cancelling O(log n) without any allocation beyond growing the heap.
+ * Every event loop thread has a heap of its own.
+ */
+
+#include "wsdd.h"
+
+#include <stdlib.h> // realloc(), free()
+#include <string.h> // strerror()
+#include <errno.h> // ENOMEM
+
+static __thread struct timer **heap;
+static __thread size_t nheap, heap_cap;
+
+long long mono_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void heap_set(size_t i, struct timer *t)
+{
+	heap[i] = t;
+	t->slot = i + 1;
+}
+
+static void sift_up(size_t i)
+{
+	struct timer *t = heap[i];
+
+	while (i > 0 && heap[(i - 1) / 2]->when > t->when) {
+		heap_set(i, heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	heap_set(i, t);
+}
+
+static void sift_down(size_t i)
+{
+	struct timer *t = heap[i];
+
+	for (;;) {
+		size_t c = 2 * i + 1;
+
+		if (c >= nheap)
+			break;
+		if (c + 1 < nheap && heap[c + 1]->when < heap[c]->when)
+			c++;
+		if (heap[c]->when >= t->when)
+			break;
+		heap_set(i, heap[c]);
+		i = c;
+	}
+	heap_set(i, t);
+}
+
+/*
+ * Remove t from the heap; a no-op if it is not armed.
+ */
+void timer_cancel(struct timer *t)
+{
+	if (!t->slot)
+		return;
+
+	size_t i = t->slot - 1;
+	struct timer *last = heap[--nheap];
+
+	t->slot = 0;
+	if (last == t)
+		return;
+
+	heap_set(i, last);
+	if (i > 0 && heap[(i - 1) / 2]->when > last->when)
+		sift_up(i);
+	else
+		sift_down(i);
+}
+
+/*
+ * (Re)arm t to call fn(arg) in delay msec, and then every period msec
+ * unless period is 0.
+ */
+int timer_set(struct timer *t, long long delay, long long period,
+		void (*fn)(void *), void *arg)
+{
+	timer_cancel(t);
+
+	t->when = mono_ms() + delay;
+	t->period = period;
+	t->fn = fn;
+	t->arg = arg;
+
+	if (nheap == heap_cap) {
+		size_t ncap = heap_cap ? heap_cap * 2 : 16;
+		struct timer **nh = realloc(heap, ncap * sizeof(*nh));
+
+		if (!nh) {
+			LOG(LOG_WARNING, "%s: %s", __func__, strerror(ENOMEM));
+			return -1;
+		}
+		heap = nh;
+		heap_cap = ncap;
+	}
+
+	heap[nheap] = t;
+	sift_up(nheap++);
+	return 0;
+}
+
+/* Milliseconds until the earliest timer is due, or -1 if none is armed. */
+int timer_timeout(void)
+{
+	if (!nheap)
+		return -1;
+	return (int) MAX(0, heap[0]->when - mono_ms());
+}
+
+/*
+ * Fire every timer that is due. A periodic timer is rearmed before its
+ * callback runs, so the callback may cancel it or free its owner.
+ */
+void timer_run(void)
+{
+	long long now = mono_ms();
+
+	while (nheap && heap[0]->when <= now) {
+		struct timer *t = heap[0];
+
+		if (t->period) {
+			t->when += t->period;
+			if (t->when <= now)
+				t->when = now + t->period;
+			sift_down(0);
+		} else {
+			timer_cancel(t);
+		}
+		t->fn(t->arg);
+	}
+}
+
+void timer_free(void)
+{
+	for (size_t i = 0; i < nheap; i++)
+		heap[i]->slot = 0;
+	free(heap);
+	heap = NULL;
+	nheap = heap_cap = 0;
+}
@@ -0,0 +1,423 @@
+/*
+   WSDD - Web Service Dynamic Discovery protocol server
+
+   io_uring event loop backend (build with "make USE_IO_URING=1")
+
+	Copyright (c) 2016 NETGEAR
+	Copyright (c) 2016 Hiro Sugawara
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Every datagram endpoint (UDP and netlink) gets one multishot recvmsg
+ * that picks buffers from a shared provided buffer ring, and every TCP
+ * listener gets one multishot accept. Completions are reaped in batches
+ * and handed to the service input()/serve() callbacks, so a burst of
+ * queries costs one io_uring_enter() rather than a poll and a recv per
+ * packet. Only the receive path goes through the ring: replies are still
+ * sent synchronously by the services, as with epoll.
+ *
+ * The ring is created per service (re)start and torn down before the
+ * endpoints are closed: closing a socket does not cancel requests that
+ * hold a reference to it.
+ */
+
+#define _GNU_SOURCE
+
+#include "wsdd.h"
+
+#include <stdlib.h> // calloc(), free()
+#include <string.h> // memset(), memcpy()
+#include <unistd.h> // syscall(), close()
+#include <errno.h> // errno
+#include <poll.h> // POLLIN
+#include <sys/mman.h> // mmap(), munmap()
+#include <sys/socket.h> // struct msghdr, getpeername()
+#include <sys/syscall.h> // __NR_io_uring_setup
+#include <linux/io_uring.h> // struct io_uring_params
+
+#define URING_ENTRIES	256
+#define URING_BUFS	256		/* power of 2 */
+#define URING_BUFSIZE	(16 * 1024)
+#define URING_BGID	0
+
+static struct {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+	unsigned sqe_tail, to_submit;
+
+	struct io_uring_buf_ring *br;
+	size_t br_sz;
+	char *bufs;
+	unsigned short br_tail;
+} ring = { .fd = -1 };
+
+/* Shared by all multishot recvmsg requests: only the lengths are used. */
+static struct msghdr uring_msg = {
+	.msg_namelen = sizeof(_saddr_t),
+	.msg_controllen = CMSG_SPACE(sizeof(struct in6_pktinfo)),
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+			struct io_uring_getevents_arg *arg)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags | (arg ? IORING_ENTER_EXT_ARG : 0), arg, arg ? sizeof(*arg) : 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_buf_recycle(unsigned short bid)
+{
+	struct io_uring_buf *b = &ring.br->bufs[ring.br_tail & (URING_BUFS - 1)];
+
+	b->addr = (unsigned long) (ring.bufs + (size_t) bid * URING_BUFSIZE);
+	b->len = URING_BUFSIZE - 1; /* spare byte for the datagram NUL */
+	b->bid = bid;
+	__atomic_store_n(&ring.br->tail, ++ring.br_tail, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+	if (ring.sqe_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries) {
+		if (io_uring_enter(ring.fd, ring.to_submit, 0, 0, NULL) < 0)
+			return NULL;
+		ring.to_submit = 0;
+	}
+
+	unsigned idx = ring.sqe_tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[idx] = idx;
+	__atomic_store_n(ring.sq_tail, ++ring.sqe_tail, __ATOMIC_RELEASE);
+	ring.to_submit++;
+	return sqe;
+}
+
+int uring_add_ep(struct endpoint *ep)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	if (!sqe) {
+		ep->errstr = "uring_add_ep: io_uring_enter";
+		ep->_errno = errno;
+		return -1;
+	}
+
+	sqe->fd = ep->sock;
+	sqe->user_data = (unsigned long) ep;
+
+	if (ep->conn) {
+		/* One-shot, so a connection closed from its own completion has
+		 * nothing left in flight. */
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = ep->conn->out ? POLLOUT : POLLIN;
+		ep->conn->armed = true;
+	} else if (ep->type == SOCK_STREAM) {
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	} else {
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->addr = (unsigned long) &uring_msg;
+		sqe->len = 1;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
+	}
+
+	return 0;
+}
+
+/*
+ * Cancel the multishot request of an endpoint that is about to be freed
+ * and scrub its completions that have not been dispatched yet, so that
+ * nothing in the ring refers to the endpoint afterwards.
+ */
+void uring_del_ep(struct endpoint *ep)
+{
+	if (ep->conn && !ep->conn->armed)
+		return;
+
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	if (!sqe) {
+		LOG(LOG_WARNING, "%s: %s: %s", __func__, ep->service->name, strerror(errno));
+		return;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (unsigned long) ep;
+
+	unsigned head = *ring.cq_head, seen = head;
+	bool done = false;
+
+	while (!done) {
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; seen != tail; seen++) {
+			struct io_uring_cqe *cqe = &ring.cqes[seen & *ring.cq_mask];
+
+			if (cqe->user_data != (unsigned long) ep)
+				continue;
+			if (cqe->flags & IORING_CQE_F_BUFFER)
+				uring_buf_recycle(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			else if (ep->type == SOCK_STREAM && !ep->conn && cqe->res >= 0)
+				close(cqe->res);
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				done = true;
+			cqe->user_data = 0;
+			cqe->flags = 0;
+		}
+
+		/* Wait for one completion beyond those already scanned. */
+		if (!done && io_uring_enter(ring.fd, ring.to_submit, seen - head + 1,
+						IORING_ENTER_GETEVENTS, NULL) < 0 && errno != EINTR) {
+			LOG(LOG_WARNING, "%s: %s: %s", __func__, ep->service->name, strerror(errno));
+			return;
+		}
+		ring.to_submit = 0;
+	}
+}
+
+static int uring_recvmsg(struct endpoint *ep, const struct io_uring_cqe *cqe)
+{
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+		return 0;
+
+	unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	char *buf = ring.bufs + (size_t) bid * URING_BUFSIZE;
+	struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) buf;
+	size_t hdrlen = sizeof(*out) + uring_msg.msg_namelen + uring_msg.msg_controllen;
+
+	if ((size_t) cqe->res < hdrlen) {
+		uring_buf_recycle(bid);
+		return 0;
+	}
+
+	struct datagram dg = {
+		.buf = buf + hdrlen,
+		.len = cqe->res - hdrlen,
+	};
+	memcpy(&dg.from, out + 1, MIN(out->namelen, sizeof(dg.from)));
+
+	struct msghdr msg = {
+		.msg_control = (char *) (out + 1) + uring_msg.msg_namelen,
+		.msg_controllen = MIN(out->controllen, uring_msg.msg_controllen),
+	};
+	datagram_pktinfo(&dg, &msg);
+
+	DEBUG(3, W, "dispatch %s input (len=%zu)", ep->service->name, dg.len);
+	if ((ep = demux_ep(ep, &dg)) && ep->service->input)
+		ep->service->input(ep, &dg);
+
+	uring_buf_recycle(bid);
+	return 0;
+}
+
+static int uring_accept(struct endpoint *ep, const struct io_uring_cqe *cqe)
+{
+	_saddr_t sa = {};
+	socklen_t slen = sizeof sa;
+	int fd = cqe->res;
+
+	getpeername(fd, &sa.sa, &slen);
+
+	DEBUG(3, W, "dispatch %s accept (fd=%d)", ep->service->name, fd);
+	return open_conn(ep, fd, &sa);
+}
+
+/*
+ * Submit pending requests, wait up to timeout_ms (-1: forever) for at
+ * least one completion and dispatch everything that has completed.
+ * Returns the number of completions handled or -1 with errno set.
+ */
+int uring_wait(int timeout_ms)
+{
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = (timeout_ms % 1000) * 1000000LL,
+	};
+	struct io_uring_getevents_arg arg = {
+		.ts = (unsigned long) &ts,
+	};
+	int n = io_uring_enter(ring.fd, ring.to_submit, 1, IORING_ENTER_GETEVENTS,
+				timeout_ms >= 0 ? &arg : NULL);
+
+	netif_online();
+	/*
+	 * Timed out or interrupted (stopped and resumed, a signal handled):
+	 * still reap whatever has completed. Nothing was submitted then, so
+	 * the requests are kept for the next call.
+	 */
+	if (n < 0 && errno != ETIME && errno != EINTR)
+		return -1;
+	if (n >= 0)
+		ring.to_submit = 0;
+
+	unsigned head = *ring.cq_head;
+	int done = 0;
+
+	while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+		struct endpoint *ep = (struct endpoint *) (unsigned long) cqe.user_data;
+
+		/* Consume before dispatch: a handler may longjmp() away. */
+		__atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+		done++;
+
+		if (!ep)
+			continue;
+
+		if (ep->conn) {
+			ep->conn->armed = false;
+			if (conn_recv(ep->conn) && uring_add_ep(ep))
+				LOG(LOG_WARNING, "%s: %s: %s", ep->service->name,
+					ep->errstr, strerror(ep->_errno));
+			continue;
+		}
+
+		if (cqe.res < 0 && cqe.res != -ENOBUFS) {
+			ep->errstr = (ep->type == SOCK_STREAM) ?
+				"uring_wait: accept" : "uring_wait: recvmsg";
+			ep->_errno = -cqe.res;
+			DEBUG(1, W, "Detected %s socket error, restarting: %s",
+				ep->service->name, strerror(ep->_errno));
+			restart_service();
+		}
+
+		if (cqe.res == -ENOBUFS)
+			DEBUG(2, W, "%s: out of provided buffers", ep->service->name);
+		else if (ep->type == SOCK_STREAM)
+			uring_accept(ep, &cqe);
+		else
+			uring_recvmsg(ep, &cqe);
+
+		/* The kernel ended this multishot request: re-arm it. */
+		if (!(cqe.flags & IORING_CQE_F_MORE) && uring_add_ep(ep))
+			LOG(LOG_WARNING, "%s: %s: %s", ep->service->name,
+				ep->errstr, strerror(ep->_errno));
+	}
+
+	DEBUG(4, W, "uring_wait: n=%d", done);
+	return done;
+}
+
+int uring_init(void)
+{
+	struct io_uring_params p = {};
+
+	memset(&ring, 0, sizeof ring);
+	ring.fd = io_uring_setup(URING_ENTRIES, &p);
+	if (ring.fd < 0)
+		return -1;
+
+	ring.sq_entries = p.sq_entries;
+	ring.sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring.sq_ring_sz = ring.cq_ring_sz = MAX(ring.sq_ring_sz, ring.cq_ring_sz);
+
+	ring.sq_ring = mmap(NULL, ring.sq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ring == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring.cq_ring = ring.sq_ring;
+	} else {
+		ring.cq_ring = mmap(NULL, ring.cq_ring_sz, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+		if (ring.cq_ring == MAP_FAILED)
+			goto fail;
+	}
+
+	ring.sqes = mmap(NULL, ring.sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		goto fail;
+
+	ring.sq_head = (unsigned *) ((char *) ring.sq_ring + p.sq_off.head);
+	ring.sq_tail = (unsigned *) ((char *) ring.sq_ring + p.sq_off.tail);
+	ring.sq_mask = (unsigned *) ((char *) ring.sq_ring + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *) ((char *) ring.sq_ring + p.sq_off.array);
+	ring.cq_head = (unsigned *) ((char *) ring.cq_ring + p.cq_off.head);
+	ring.cq_tail = (unsigned *) ((char *) ring.cq_ring + p.cq_off.tail);
+	ring.cq_mask = (unsigned *) ((char *) ring.cq_ring + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) ((char *) ring.cq_ring + p.cq_off.cqes);
+	ring.sqe_tail = *ring.sq_tail;
+
+	ring.br_sz = URING_BUFS * sizeof(struct io_uring_buf);
+	ring.br = mmap(NULL, ring.br_sz, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring.br == MAP_FAILED)
+		goto fail;
+
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (unsigned long) ring.br,
+		.ring_entries = URING_BUFS,
+		.bgid = URING_BGID,
+	};
+	if (io_uring_register(ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+		goto fail;
+
+	ring.bufs = (char *) malloc((size_t) URING_BUFS * URING_BUFSIZE);
+	if (!ring.bufs)
+		goto fail;
+	for (unsigned short bid = 0; bid < URING_BUFS; bid++)
+		uring_buf_recycle(bid);
+
+	return 0;
+
+fail:
+	{
+		int _errno = errno;
+		uring_exit();
+		errno = _errno;
+	}
+	return -1;
+}
+
+void uring_exit(void)
+{
+	if (ring.fd >= 0)
+		close(ring.fd);
+	if (ring.sqes && ring.sqes != MAP_FAILED)
+		munmap(ring.sqes, ring.sqes_sz);
+	if (ring.cq_ring && ring.cq_ring != MAP_FAILED && ring.cq_ring != ring.sq_ring)
+		munmap(ring.cq_ring, ring.cq_ring_sz);
+	if (ring.sq_ring && ring.sq_ring != MAP_FAILED)
+		munmap(ring.sq_ring, ring.sq_ring_sz);
+	if (ring.br && ring.br != MAP_FAILED)
+		munmap(ring.br, ring.br_sz);
+	free(ring.bufs);
+	memset(&ring, 0, sizeof ring);
+	ring.fd = -1;
+}
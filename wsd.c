@@ -57,19 +57,17 @@
 
 #include <stdbool.h> // bool
 #include <stdio.h> // FILE, fopen(), fscanf(), snprintf(), asprintf()
-#include <stdlib.h> // srand48(), strtoul()
-#include <unistd.h> // usleep()
+#include <stdlib.h> // jrand48(), strtoul()
 #include <string.h> // strcmp(), strdup(), strncpy()
 #include <ctype.h> // isdigit(), isspace()
-#include <time.h> // time_t, time()
+#include <time.h> // time_t, time(), gmtime_r()
+#include <pthread.h> // pthread_self()
 #include <errno.h> // errno
 #include <sys/socket.h> // sendto()
 #include <arpa/inet.h> // inet_ntop()
 
-#define UUIDLEN	37
-
 static time_t wsd_instance;
-static char wsd_sequence[UUIDLEN], wsd_endpoint[UUIDLEN];
+static char wsd_sequence[UUIDLEN];
 
 static void uuid_endpoint(char uuid[UUIDLEN]);
 
@@ -86,6 +84,10 @@ static int uuid_parse(char uuid[UUIDLEN], unsigned short UUID[8])
 	return 0;
 }
 
+/* Every event loop thread draws from a generator of its own. */
+static __thread unsigned short rand_state[3];
+static __thread bool seeded;
+
 static void set_seed(void)
 {
 	char uuid[UUIDLEN];
@@ -101,26 +103,31 @@ static void set_seed(void)
 		unsigned long s = UUID[2*i+1] | UUID[2*i+0] << 16;
 		seed ^= s;
 	}
+	seed ^= (unsigned long) pthread_self();
 
-	srand48(seed);
+	/* The same state srand48(seed) would set up. */
+	rand_state[0] = 0x330e;
+	rand_state[1] = seed;
+	rand_state[2] = seed >> 16;
+	seeded = true;
 }
 
-static void uuid_random(char *uuid, size_t len)
+static long wsd_random(void)
 {
-	static bool seeded = false;
-
-	if (!seeded) {
+	if (!seeded)
 		set_seed();
-		seeded = true;
-	}
+	return jrand48(rand_state);
+}
 
+static void uuid_random(char *uuid, size_t len)
+{
 	snprintf(uuid, len, "%08lx-%04lx-%04lx-%04lx-%08lx%04lx",
-			mrand48() & 0xffffffff,
-			mrand48() & 0xffff,
-			mrand48() & 0xffff,
-			mrand48() & 0xffff,
-			mrand48() & 0xffffffff,
-			mrand48() & 0xffff);
+			wsd_random() & 0xffffffff,
+			wsd_random() & 0xffff,
+			wsd_random() & 0xffff,
+			wsd_random() & 0xffff,
+			wsd_random() & 0xffffffff,
+			wsd_random() & 0xffff);
 }
 
 static void uuid_endpoint(char uuid[UUIDLEN])
@@ -453,27 +460,29 @@ enum wsd_action wsd_action_id(const struct wsd_req_info *info)
 	return WSD_ACTION_NONE;
 }
 
+/*
+ * Send msg; a datagram with rwait > 0 is queued to go out after a random
+ * delay of less than rwait msec.
+ */
 static int wsd_send_msg(int fd, struct endpoint *ep, const _saddr_t *sa,
 			const char *msg, size_t msglen, unsigned int rwait)
 {
+	unsigned int delay = rwait ? (unsigned long) wsd_random() % rwait : 0;
 	int ret;
 
 	errno = 0;
 	if (ep->type == SOCK_STREAM) {
-		ret = send(fd, msg, msglen, MSG_NOSIGNAL);
+		ret = conn_send(ep->conn, msg, msglen, 0);
+	} else if (delay) {
+		ret = send_datagram_later(ep, fd, msg, msglen, sa, delay) ? -1 : (int) msglen;
 	} else {
-		if (rwait) {
-			useconds_t us = random() % rwait;
-			usleep(us);
-		}
-		ret = sendto(fd, msg, msglen, MSG_NOSIGNAL, (struct sockaddr *)sa,
-			(ep->family == AF_INET) ? sizeof sa->in : sizeof sa->in6);
+		ret = send_datagram(ep, fd, msg, msglen, sa);
 	}
 
 	char ip[_ADDRSTRLEN];
 	inet_ntop(sa->ss.ss_family, _SIN_ADDR(sa), ip, sizeof ip);
-	DEBUG(3, W, "WSD-TO %s port %u (fd=%d,len=%ld,sent=%d) '%s'\n", ip, _SIN_PORT(sa), fd,
-		msglen, ret, msg);
+	DEBUG(3, W, "WSD-TO %s port %u (fd=%d,len=%ld,sent=%d,delay=%u) '%s'\n", ip, _SIN_PORT(sa),
+		fd, msglen, ret, delay, msg);
 
 	return ret != (int) msglen;
 }
@@ -532,17 +541,15 @@ static int wsd_send_soap_fault(int fd, struct endpoint *ep, _saddr_t *sa,
 /*
  * complete and generate the whole WSD SOAP message
  */
-static int wsd_send_soap_msg(int fd, struct endpoint *ep,
-				const _saddr_t *sa,
+/*
+ * Build a complete SOAP message into *msg. Returns its length, or -1.
+ */
+static ssize_t wsd_soap_msg(char **msg, struct endpoint *ep,
 				const char *to,
 				const char *action, const char *relates,
-				const char *body,
-				int (*header)(int fd, struct endpoint *ep,
-						const _saddr_t *sa,
-						int status, size_t len),
-				int status)
+				const char *body)
 {
-#define __FUNCTION__ "wsd_send_soap_msg"
+#define __FUNCTION__ "wsd_soap_msg"
 	static unsigned int msg_no;
 	static const char soap_msg_templ[] =
 	"<?xml version=\"1.0\" encoding=\"utf-8\"?>"
@@ -565,7 +572,7 @@ static int wsd_send_soap_msg(int fd, struct endpoint *ep,
 	"%s"
 	"</soap:Envelope>";
 
-	char msg_id[UUIDLEN], *soap_relates, *msg;
+	char msg_id[UUIDLEN], *soap_relates;
 
 	uuid_random(msg_id, sizeof msg_id);
 
@@ -584,9 +591,9 @@ static int wsd_send_soap_msg(int fd, struct endpoint *ep,
 		}
 	}
 
-	ssize_t msglen = asprintf(&msg, soap_msg_templ, to, action, msg_id,
+	ssize_t msglen = asprintf(msg, soap_msg_templ, to, action, msg_id,
 				(long long)wsd_instance, wsd_sequence,
-				++msg_no, soap_relates,
+				__atomic_add_fetch(&msg_no, 1, __ATOMIC_RELAXED), soap_relates,
 				body);
 	free(soap_relates);
 
@@ -596,12 +603,33 @@ static int wsd_send_soap_msg(int fd, struct endpoint *ep,
 		return -1;
 	}
 
+	return msglen;
+#undef __FUNCTION__
+}
+
+static int wsd_send_soap_msg(int fd, struct endpoint *ep,
+				const _saddr_t *sa,
+				const char *to,
+				const char *action, const char *relates,
+				const char *body,
+				int (*header)(int fd, struct endpoint *ep,
+						const _saddr_t *sa,
+						int status, size_t len),
+				int status, unsigned int rwait)
+{
+#define __FUNCTION__ "wsd_send_soap_msg"
+	char *msg;
+	ssize_t msglen = wsd_soap_msg(&msg, ep, to, action, relates, body);
+
+	if (msglen < 0)
+		return -1;
+
 	int rv = 0;
 	if (header)
 		rv = header(fd, ep, sa, status, msglen);
 
 	if (rv == 0) {
-		rv = wsd_send_msg(fd, ep, sa, msg, msglen, 0);
+		rv = wsd_send_msg(fd, ep, sa, msg, msglen, rwait);
 		if (rv) {
 			ep->errstr = __FUNCTION__ ": send";
 			ep->_errno = errno;
@@ -614,7 +642,54 @@ static int wsd_send_soap_msg(int fd, struct endpoint *ep,
 #undef __FUNCTION__
 }
 
-static int wsd_send_hello(struct endpoint *ep)
+/*
+ * Multicast one announcement to every endpoint in eps[], all of the same
+ * service: the message is built once per run of endpoints with the same
+ * identity, whose endpoint UUID body_templ takes, and sent in sendmmsg()
+ * batches.
+ */
+static int wsd_announce(struct endpoint **eps, size_t n, const char *action,
+			const char *body_templ)
+{
+	int rv = 0;
+
+	for (size_t i = 0, j; i < n; i = j) {
+		const struct identity *id = eps[i]->identity;
+		char *body, *msg;
+
+		for (j = i + 1; j < n && eps[j]->identity == id; j++)
+			;
+
+		if (asprintf(&body, body_templ, id->endpoint) <= 0) {
+			eps[0]->errstr = "wsd_announce: asprintf";
+			eps[0]->_errno = ENOMEM;
+			return -1;
+		}
+
+		ssize_t msglen = wsd_soap_msg(&msg, eps[i], WSD_TO_DISCOVERY, action, NULL, body);
+		free(body);
+
+		if (msglen < 0) {
+			eps[0]->errstr = eps[i]->errstr;
+			eps[0]->_errno = eps[i]->_errno;
+			return -1;
+		}
+
+		DEBUG(3, W, "WSD-TO %s x%zu (len=%zd) '%s'\n", eps[i]->service->mcast_addr, j - i,
+			msglen, msg);
+
+		if (send_mcast_batch(&eps[i], j - i, msg, msglen)) {
+			eps[0]->errstr = "wsd_announce: send";
+			eps[0]->_errno = errno;
+			rv = -1;
+		}
+
+		free(msg);
+	}
+	return rv;
+}
+
+static int wsd_send_hello(struct endpoint **eps, size_t n)
 {
 	static const char body_templ[] =
 		"<soap:Body>"
@@ -626,22 +701,11 @@ static int wsd_send_hello(struct endpoint *ep)
 		"<wsd:MetadataVersion>2</wsd:MetadataVersion>"
 		"</wsd:Hello>"
 		"</soap:Body>";
-	char *body;
 
-	if (asprintf(&body, body_templ, wsd_endpoint) <= 0) {
-		ep->errstr = "wsd_send_hello: asprintf";
-		ep->_errno = ENOMEM;
-		return -1;
-	}
-
-	int rv = wsd_send_soap_msg(ep->sock, ep, &ep->mcast, WSD_TO_DISCOVERY,
-				WSD_ACT_HELLO, NULL, body, NULL, 0);
-
-	free(body);
-	return rv;
+	return wsd_announce(eps, n, WSD_ACT_HELLO, body_templ);
 }
 
-static int wsd_send_bye(struct endpoint *ep)
+static int wsd_send_bye(struct endpoint **eps, size_t n)
 {
 	static const char body_templ[] =
 		"<soap:Body>"
@@ -653,25 +717,15 @@ static int wsd_send_bye(struct endpoint *ep)
 		"<wsd:MetadataVersion>2</wsd:MetadataVersion>"
 		"</wsd:Bye>"
 		"</soap:Body>";
-	char *body;
 
-	if (asprintf(&body, body_templ, wsd_endpoint) <= 0) {
-		ep->errstr = "wsd_send_bye: asprintf";
-		ep->_errno = ENOMEM;
-		return -1;
-	}
-
-	int rv = wsd_send_soap_msg(ep->sock, ep, &ep->mcast, WSD_TO_DISCOVERY,
-				WSD_ACT_BYE, NULL, body, NULL, 0);
-
-	free(body);
-	return rv;
+	return wsd_announce(eps, n, WSD_ACT_BYE, body_templ);
 }
 
 static int wsd_send_probe_match(int fd,
 				struct endpoint *ep,
 				const _saddr_t *sa,
 				const struct wsd_req_info *info,
+				const struct identity *id,
 				const char *ip)
 {
 	static const char body_templ[] =
@@ -689,7 +743,7 @@ static int wsd_send_probe_match(int fd,
 		"</soap:Body>";
 	char *body, *uri_ip = ip2uri(ip);
 
-	if (!uri_ip || asprintf(&body, body_templ, wsd_endpoint, uri_ip, ep->port, wsd_endpoint) <= 0) {
+	if (!uri_ip || asprintf(&body, body_templ, id->endpoint, uri_ip, ep->port, id->endpoint) <= 0) {
 		ep->errstr = "wsd_send_probe_match: ip2uri/asprintf";
 		ep->_errno = errno;
 		free(uri_ip);
@@ -697,7 +751,7 @@ static int wsd_send_probe_match(int fd,
 	}
 
 	int rv = wsd_send_soap_msg(fd, ep, sa, WSD_TO_ANONYMOUS,
-				WSD_ACT_PROBEMATCH, info->msgid, body, NULL, 0);
+				WSD_ACT_PROBEMATCH, info->msgid, body, NULL, 0, info->reply_delay);
 
 	free(uri_ip);
 	free(body);
@@ -708,6 +762,7 @@ static int wsd_send_resolve_match(int fd,
 				struct endpoint *ep,
 				const _saddr_t *sa,
 				const struct wsd_req_info *info,
+				const struct identity *id,
 				const char *ip)
 {
 	const char body_templ[] =
@@ -725,7 +780,7 @@ static int wsd_send_resolve_match(int fd,
 		"</soap:Body>";
 	char *body, *uri_ip = ip2uri(ip);
 
-	if (!uri_ip || asprintf(&body, body_templ, wsd_endpoint, uri_ip, ep->port, wsd_endpoint) <= 0) {
+	if (!uri_ip || asprintf(&body, body_templ, id->endpoint, uri_ip, ep->port, id->endpoint) <= 0) {
 		ep->errstr = "wsd_send_resolve_match: ip2uri/asprintf";
 		ep->_errno = errno;
 		free(uri_ip);
@@ -733,7 +788,7 @@ static int wsd_send_resolve_match(int fd,
 	}
 
 	int err = wsd_send_soap_msg(fd, ep, sa, WSD_TO_ANONYMOUS,
-				WSD_ACT_RESOLVEMATCH, info->msgid, body, NULL, 0);
+				WSD_ACT_RESOLVEMATCH, info->msgid, body, NULL, 0, info->reply_delay);
 
 	free(uri_ip);
 	free(body);
@@ -782,9 +837,10 @@ static int send_http_resp_header(int fd, struct endpoint *ep,
 
 	char time_str[32];
 	time_t t;
+	struct tm tm;
 
 	time(&t);
-	strftime(time_str, sizeof(time_str), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&t));
+	strftime(time_str, sizeof(time_str), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&t, &tm));
 
 	char *s;
 	ssize_t len = asprintf(&s, resp_hdr_fmt, status_str, time_str, length);
@@ -797,7 +853,7 @@ static int send_http_resp_header(int fd, struct endpoint *ep,
 
 	DEBUG(4, W, "---------- HEADER:\n%s----------\n", s);
 
-	if (wsd_send_msg(fd, ep, sa, s, len, WSD_RANDOM_DELAY) != 0) {
+	if (wsd_send_msg(fd, ep, sa, s, len, 0) != 0) {
 		ep->errstr = "send_http_resp_header: send";
 		ep->_errno = errno;
 		rv = -1;
@@ -811,6 +867,7 @@ static int wsd_send_get_response(int fd,
 				struct endpoint *ep,
 				const _saddr_t *sa,
 				const struct wsd_req_info *info,
+				const struct identity *id,
 				const char *ip)
 {
 	char *body;
@@ -863,10 +920,10 @@ static int wsd_send_get_response(int fd,
 				get_getresp("model:"),
 				get_getresp("modelurl:"),
 				get_getresp("presentationurl:"),
-				wsd_endpoint,
-				wsd_endpoint,
-				netbiosname,
-				workgroup
+				id->endpoint,
+				id->endpoint,
+				id->netbiosname,
+				id->workgroup
 			);
 
 	(void) ip; // silent "unused" warning
@@ -878,35 +935,58 @@ static int wsd_send_get_response(int fd,
 	}
 
 	int rv = wsd_send_soap_msg(fd, ep, sa, WSD_TO_ANONYMOUS,
-				WXT_ACT_GETRESPONSE, info->msgid, body, send_http_resp_header, 200);
+				WXT_ACT_GETRESPONSE, info->msgid, body, send_http_resp_header, 200, 0);
 
 	free(body);
 	return rv;
 }
 
+/*
+ * Whether buf holds a complete request: for a POST, the whole header and
+ * as much body as its Content-Length announces. Anything that is not a
+ * POST is passed on as it is.
+ */
+static bool wsd_http_complete(const char *buf, size_t len)
+{
+	if (strncmp(buf, "POST ", MIN(len, 5)) != 0)
+		return true;
+
+	const char *eoh = strstr(buf, "\r\n\r\n");
+	if (len < 5 || !eoh)
+		return false;
+
+	size_t contentlength = 0;
+	for (const char *p = strstr(buf, "\r\n") + 2; p < eoh + 2; p = strstr(p, "\r\n") + 2)
+		if (strncasecmp(p, "Content-Length:", 15) == 0)
+			contentlength = strtoul(p + 15, NULL, 10);
+
+	return len - (eoh + 4 - buf) >= contentlength;
+}
+
 /*
  * Validate HTTP POST header lines.
  * Re-fill buffer with HTTP body.
  * Return MIME error code.
  */
-static int wsd_parse_http_header(int fd, struct endpoint *ep,
+static int wsd_parse_http_header(struct endpoint *ep, const char *endpoint,
 				char *buf, size_t len, size_t bsize)
 {
 #define __FUNCTION__	"wsd_pars_http_header"
 	size_t contentlength = 0;
 	char *p = buf;
 	char *eol = strstr(p, "\r\n");
-	static size_t endpointlen;
-
-	if (!endpointlen)
-		endpointlen = strlen(wsd_endpoint);
+	size_t endpointlen = strlen(endpoint);
 
+	if (!eol) {
+		ep->errstr = __FUNCTION__ ": Incomplete request line";
+		return 400;
+	}
 	*eol = '\0';
 	if (strncmp(p, "POST /", 6) != 0) {
 		ep->errstr = __FUNCTION__ ": Only POST method supported";
 		return 405;
 	}
-	if (strncmp(p + 6, wsd_endpoint, endpointlen) != 0) {
+	if (strncmp(p + 6, endpoint, endpointlen) != 0) {
 		ep->errstr = __FUNCTION__ ": Invalid endpoint UUID";
 		return 404;
 	}
@@ -917,7 +997,6 @@ static int wsd_parse_http_header(int fd, struct endpoint *ep,
 
 	p = eol + 2;
 
-again:
 #define HEADER_IS(p,h) (strncasecmp((p), (h), strlen((h))) ? NULL : (p) + strlen(h))
 	while (*p && (eol = strstr(p, "\r\n")) != p) {
 		const char *val;
@@ -951,16 +1030,9 @@ again:
 	memmove(buf, p, len -= (p - buf));
 	buf[len] = '\0';
 
-	if (!eoh) { /* Have not reached end of header. */
-		ssize_t len2 = recv(fd, buf + len, bsize - len - 1, 0);
-
-		if (len2 <= 0) {
-			ep->errstr = __FUNCTION__ ": Data receiving error";
-			return 500;
-		}
-		len += len2;
-		buf[len] = '\0';
-		goto again;
+	if (!eoh) { /* wsd_http_complete() has seen it, so it is malformed */
+		ep->errstr = __FUNCTION__ ": Incomplete header";
+		return 400;
 	}
 
 	if (!contentlength) {
@@ -968,18 +1040,13 @@ again:
 		return 400;
 	}
 
+	if (contentlength >= bsize) {
+		ep->errstr = __FUNCTION__ ": Content-Length too large";
+		return 500;
+	}
 	if (len < contentlength) {
-		if (contentlength >= bsize) {
-			ep->errstr = __FUNCTION__ ": Content-Length too large";
-			return 500;
-		}
-
-		ssize_t len2 = recv(fd, buf + len, contentlength - len, 0);
-
-		if (len2 < (ssize_t) (contentlength - len)) {
-			ep->errstr = __FUNCTION__ ": Data receiving error";
-			return 500;
-		}
+		ep->errstr = __FUNCTION__ ": Data receiving error";
+		return 500;
 	}
 
 	buf[contentlength] = '\0';
@@ -987,37 +1054,82 @@ again:
 #undef	__FUNCTION__
 }
 
-int wsd_init(struct endpoint *ep)
+/*
+ * Set the endpoint UUID of id: the machine ID for the default identity
+ * (base NULL), else base's UUID scrambled with id's NetBIOS name, so that
+ * a profile keeps its UUID across restarts however -P are ordered.
+ */
+void wsd_set_endpoint(struct identity *id, const struct identity *base)
+{
+	if (!base) {
+		uuid_endpoint(id->endpoint);
+		return;
+	}
+
+	if (!base->endpoint[0]) {
+		id->endpoint[0] = '\0';
+		return;
+	}
+
+	/*
+	 * FNV-1a of the name, XORed into the hex digits but for the version
+	 * digit, which is kept, and the variant bits, which are set to RFC 4122.
+	 */
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	for (const char *p = id->netbiosname; *p; p++)
+		h = (h ^ (unsigned char) toupper(*p)) * 0x100000001b3ULL;
+
+	strcpy(id->endpoint, base->endpoint);
+	for (char *p = id->endpoint; *p; p++) {
+		if (*p == '-')
+			continue;
+		int v = isdigit(*p) ? *p - '0' : *p - 'a' + 10;
+		if (p - id->endpoint == 19)
+			v = 0x8 | ((v ^ h) & 0x3);
+		else if (p - id->endpoint != 14)
+			v = (v ^ h) & 0xf;
+		*p = "0123456789abcdef"[v];
+		h = h >> 4 | h << 60;
+	}
+}
+
+int wsd_init_batch(struct endpoint **eps, size_t n)
 {
 	if (!wsd_instance)
 		time(&wsd_instance);
 	if (!wsd_sequence[0])
 		uuid_random(wsd_sequence, sizeof(wsd_sequence));
-	if (!wsd_endpoint[0]) {
-		uuid_endpoint(wsd_endpoint);
-		if (!wsd_endpoint[0]) {
-			ep->errstr = "wsd_init: uuid_endpoint";
-			ep->_errno = errno;
+	for (size_t i = 0; i < n; i++) {
+		if (!eps[i]->identity->endpoint[0]) {
+			eps[0]->errstr = "wsd_init: uuid_endpoint";
+			eps[0]->_errno = EINVAL;
 			return -1;
 		}
 	}
 
-	return wsd_send_hello(ep);
+	return wsd_send_hello(eps, n);
+}
+
+int wsd_init(struct endpoint *ep)
+{
+	return wsd_init_batch(&ep, 1);
 }
 
 static int wsd_recv_action(int (*f)(int fd,
 				struct endpoint *ep,
 				const _saddr_t *sa,
 				const struct wsd_req_info *info,
+				const struct identity *id,
 				const char *ip),
 			int fd,
 			struct endpoint *ep,
-			const _saddr_t *sa,
+			const struct datagram *dg,
 			const struct wsd_req_info *info)
 {
+	const _saddr_t *sa = &dg->from;
 	_saddr_t ci;
 
-	if (connected_if(sa, &ci)) {
+	if (connected_if(ep, dg, &ci)) {
 		ep->errstr = "wsd_recv_action: connected_if";
 		ep->_errno = errno;
 		return -1;
@@ -1032,39 +1144,18 @@ static int wsd_recv_action(int (*f)(int fd,
 		return -1;
 	}
 
-	return f(fd, ep, sa, info, ip);
+	return f(fd, ep, sa, info, identity_find(ep, dg, &ci), ip);
 }
 
-int wsd_recv(struct endpoint *ep)
+/*
+ * Handle one complete WSD request in dg->buf. For a stream endpoint fd is
+ * the accepted connection and more data may be read into the buffer.
+ */
+static int wsd_handle(struct endpoint *ep, int fd, struct datagram *dg, size_t bsize)
 {
-	char buf[10000];
-	_saddr_t sa = {};
-	socklen_t slen = (ep->family == AF_INET) ? sizeof sa.in : sizeof sa.in6;
-	int fd = ep->sock;
-	ssize_t len;
-
-	if (ep->type == SOCK_STREAM) {
-		struct timeval to = { .tv_sec = 1, .tv_usec = 0};
-
-		fd = accept(ep->sock, (struct sockaddr *)&sa, &slen);
-		if (fd < 0) {
-			ep->errstr = "wsd_recv: accept";
-			ep->_errno = errno;
-			return -1;
-		}
-		if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &to, sizeof to) < 0) {
-			DEBUG(3, W, "Unable to set receive timeout\n");
-		}
-		len = recv(fd, buf, sizeof buf - 1, 0);
-	} else {
-		len = recvfrom(fd, buf, sizeof buf - 1, 0, (struct sockaddr *)&sa, &slen);
-	}
-
-	if (len <= 0) {
-		if (ep->sock != fd)
-			close(fd);
-		return len;
-	}
+	_saddr_t sa = dg->from;
+	char *buf = dg->buf;
+	size_t len = dg->len;
 
 	buf[len] = '\0';
 
@@ -1075,7 +1166,9 @@ int wsd_recv(struct endpoint *ep)
 	}
 
 	if (ep->type == SOCK_STREAM && strncmp(buf, "POST ", 5) == 0) {
-		int status = wsd_parse_http_header(fd, ep, buf, len, sizeof buf);
+		/* the connection's local address picks the identity */
+		int status = wsd_parse_http_header(ep, identity_find(ep, dg, &dg->to)->endpoint,
+						buf, len, bsize);
 
 		{
 			char ip[_ADDRSTRLEN];
@@ -1088,8 +1181,6 @@ int wsd_recv(struct endpoint *ep)
 			send_http_resp_header(fd, ep, &sa, status, 0);
 			if (status >= 400)
 				wsd_send_soap_fault(fd, ep, &sa, status, ep->errstr, ep->errstr);
-			if (ep->sock != fd)
-				close(fd);
 			return 0;
 		}
 	}
@@ -1097,6 +1188,10 @@ int wsd_recv(struct endpoint *ep)
 	int rv = 0;
 	struct wsd_req_info *info = wsd_req_parse(buf);
 
+	/* WS-Discovery 1.1 section 3.1.3: jitter replies to multicast queries */
+	if (info)
+		info->reply_delay = dg->mcast ? WSD_APP_MAX_DELAY : 0;
+
 	{
 		char src[_ADDRSTRLEN];
 		inet_ntop(sa.ss.ss_family, _SIN_ADDR(&sa), src, sizeof src);
@@ -1109,13 +1204,13 @@ int wsd_recv(struct endpoint *ep)
 
 	switch (wsd_action_id(info)) {
 	case WSD_ACTION_PROBE:
-		rv = wsd_recv_action(wsd_send_probe_match, fd, ep, &sa, info);
+		rv = wsd_recv_action(wsd_send_probe_match, fd, ep, dg, info);
 		break;
 	case WSD_ACTION_RESOLVE:
-		rv = wsd_recv_action(wsd_send_resolve_match, fd, ep, &sa, info);
+		rv = wsd_recv_action(wsd_send_resolve_match, fd, ep, dg, info);
 		break;
 	case WSD_ACTION_GET:
-		rv = wsd_recv_action(wsd_send_get_response, fd, ep, &sa, info);
+		rv = wsd_recv_action(wsd_send_get_response, fd, ep, dg, info);
 		break;
 	default:
 		DEBUG(2, W, "wsd_recv: Unsupported query");
@@ -1126,12 +1221,43 @@ int wsd_recv(struct endpoint *ep)
 		DEBUG(1, W, "wsd_recv: %s: %s", ep->errstr, strerror(ep->_errno));
 
 	wsd_req_destruct(info);
-	if (ep->sock != fd)
-		close(fd);
 	return 0;
 }
 
+int wsd_input(struct endpoint *ep, struct datagram *dg)
+{
+	return wsd_handle(ep, ep->sock, dg, dg->len + 1);
+}
+
+int wsd_serve(struct conn *c)
+{
+	if (!wsd_http_complete(c->buf, c->len))
+		return 1;
+
+	struct datagram dg = {
+		.from = c->from,
+		.to = c->to,
+		.buf = c->buf,
+		.len = c->len,
+	};
+
+	return wsd_handle(&c->ep, c->ep.sock, &dg, sizeof(c->buf));
+}
+
+int wsd_recv(struct endpoint *ep)
+{
+	if (ep->type == SOCK_STREAM)
+		return accept_conn(ep);
+
+	return recv_batch(ep, 10000);
+}
+
+void wsd_exit_batch(struct endpoint **eps, size_t n)
+{
+	wsd_send_bye(eps, n);
+}
+
 void wsd_exit(struct endpoint *ep)
 {
-	wsd_send_bye(ep);
+	wsd_exit_batch(&ep, 1);
 }
@@ -32,7 +32,7 @@
 #define WSD_MCAST_ADDR		("239.255.255.250")
 #define WSD_MCAST6_ADDR		("FF02::C")
 #define WSD_HTTP_TIMEOUT	120
-#define WSD_RANDOM_DELAY	50000
+#define WSD_APP_MAX_DELAY	500	/* msec */
 
 enum wsd_action {
 	WSD_ACTION_NONE,
@@ -57,6 +57,7 @@ struct wsd_req_info {
 	struct {
 		char *endpoint;
 	} resolve;
+	unsigned int reply_delay;	/* msec, jitter bound for the reply */
 };
 
 #endif
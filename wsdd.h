@@ -32,7 +32,6 @@
 #include <time.h> // time_t, time()
 
 /* wsdd2.c */
-extern const char *hostname, *hostaliases, *netbiosname, *netbiosaliases, *workgroup;
 extern int debug_L, debug_W;
 extern bool is_daemon;
 
@@ -70,6 +69,10 @@ extern bool is_daemon;
 #define MAX(a, b)	((a)>(b)?(a):(b))
 #endif
 
+#ifndef MIN
+#define MIN(a, b)	((a)<(b)?(a):(b))
+#endif
+
 #define _ADDRSTRLEN	MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)
 
 typedef union {
@@ -88,8 +91,37 @@ typedef union {
 				? (x)->in.sin_port \
 				: (x)->in6.sin6_port)
 
+struct conn;
+struct worker;
+struct netns;
+struct netif_db;
+struct identity;
+
+struct timer {
+	long long when;			/* mono_ms() */
+	long long period;		/* msec, 0 for one-shot */
+	void (*fn)(void *);
+	void *arg;
+	size_t slot;			/* heap index + 1, 0 if not armed */
+};
+
 struct endpoint {
 	char ifname[IFNAMSIZ];
+	unsigned int ifindex;
+	struct netns *ns;		/* network namespace of sock, see -n */
+	unsigned int vrf;		/* VRF device sock is bound to, 0 if none */
+	const struct identity *identity;	/* announced in Hello/Bye, see -P */
+	bool stale, fresh;
+	bool dead;			/* deleted by a worker, see worker_bury() */
+	bool shared;			/* socket shared by members, see -s */
+	bool activated;			/* listener passed in by systemd */
+	unsigned int members, members_cap;
+	struct endpoint **member;	/* of a shared socket, by ifindex */
+	struct endpoint *group;		/* owner of a shared socket */
+	struct conn *conn;		/* set if this is an accepted connection */
+	struct timer timer;		/* service->timer every service->interval */
+	struct worker *worker;		/* worker loop serving this copy, see -j */
+	struct endpoint *clone;		/* next worker copy of this listener */
 	struct endpoint *next;
 	struct service *service;
 	int family, type, protocol;
@@ -109,6 +141,40 @@ struct endpoint {
 	} mreq;
 };
 
+/*
+ * One received datagram. buf must have room for len + 1 bytes so that
+ * handlers can NUL-terminate the payload in place. to and ifindex come
+ * from IP_PKTINFO/IPV6_PKTINFO (or getsockname() for a connection); for
+ * IPv4 to is ipi_spec_dst, i.e. already the right reply source.
+ */
+struct datagram {
+	_saddr_t from, to;
+	unsigned int ifindex;
+	bool mcast;		/* sent to a multicast group */
+	void *buf;
+	size_t len;
+};
+
+/*
+ * An accepted TCP connection, read without blocking from the event loop.
+ * ep is a copy of the listening endpoint with sock set to the connection.
+ * A reply that does not fit the socket buffer waits in out, and the
+ * connection is polled for writing until it is flushed.
+ */
+#define CONN_BUFSIZE	10240
+
+struct conn {
+	struct endpoint ep;
+	_saddr_t from, to;
+	struct timer timeout;
+	bool armed;			/* io_uring poll request pending */
+	size_t len;
+	char buf[CONN_BUFSIZE];		/* buf[len] is always NUL */
+	char *out;			/* reply the socket has not taken yet */
+	size_t outlen, outoff;
+	struct conn *next;
+};
+
 struct service {
 	const char *name;
 	const int family, type, protocol;
@@ -119,17 +185,77 @@ struct service {
 	const uint32_t nl_groups;
 
 	int (*init)(struct endpoint *);
+	int (*init_batch)(struct endpoint **, size_t);	/* instead of init */
 	int (*recv)(struct endpoint *);
+	int (*input)(struct endpoint *, struct datagram *);
+	int (*serve)(struct conn *);	/* > 0: request incomplete, read on */
 	int (*timer)(struct endpoint *);
 	void (*exit)(struct endpoint *);
+	void (*exit_batch)(struct endpoint **, size_t);	/* instead of exit */
 	time_t interval;
 };
 
+struct netif {
+	unsigned int index;
+	unsigned int flags;		/* IFF_* */
+	unsigned int master;		/* IFLA_MASTER, 0 if none */
+	char name[IFNAMSIZ];
+	char kind[16];			/* IFLA_INFO_KIND, "" if none */
+	enum { NETIF_UNDECIDED, NETIF_USABLE, NETIF_UNUSABLE } verdict;
+};
+
+struct netaddr {
+	unsigned int index;		/* owning link */
+	unsigned char family, prefixlen;
+	union {
+		struct in_addr in;
+		struct in6_addr in6;
+	} addr;
+};
+
+struct netif_pattern {
+	char *glob;
+	size_t len;			/* up to the first wildcard */
+	enum { NETIF_EXACT, NETIF_PREFIX, NETIF_GLOB } kind;
+};
+
+struct netif_match {
+	struct netif_pattern *pat;
+	size_t npat, cap;
+};
+
+struct netif_table {
+	struct netif *links;
+	size_t nlinks, links_cap;
+	struct netaddr *addrs;
+	size_t naddrs, addrs_cap;
+};
+
+#define UUIDLEN	37
+
+/*
+ * The names we answer to and the WSD endpoint we announce. The default
+ * identity comes from smb.conf and -H/-N/-G; each -P profile applies to
+ * the interfaces and addresses it lists.
+ */
+struct identity {
+	const char *hostname, *hostaliases, *netbiosname, *netbiosaliases, *workgroup;
+	char endpoint[UUIDLEN];		/* WSD endpoint UUID, "" if unknown */
+	struct netif_match ifs;
+	struct netaddr *addrs;		/* index unused */
+	size_t naddrs;
+};
+
 // wsd.c
 int wsd_init(struct endpoint *);
+int wsd_init_batch(struct endpoint **, size_t);
 int wsd_recv(struct endpoint *);
+int wsd_input(struct endpoint *, struct datagram *);
+int wsd_serve(struct conn *);
 void wsd_exit(struct endpoint *);
+void wsd_exit_batch(struct endpoint **, size_t);
 
+void wsd_set_endpoint(struct identity *, const struct identity *base);
 void init_getresp(void);
 const char *get_getresp(const char *key);
 int set_getresp(const char *key, const char **endp);
@@ -138,11 +264,68 @@ void printBootInfoKeys(FILE *fp, int indent);
 // llmnr.c
 int llmnr_init(struct endpoint *);
 int llmnr_recv(struct endpoint *);
+int llmnr_input(struct endpoint *, struct datagram *);
+int llmnr_serve(struct conn *);
 void llmnr_exit(struct endpoint *);
 
 // wsdd2.c
-int connected_if(const _saddr_t *, _saddr_t *);
+int connected_if(const struct endpoint *, const struct datagram *, _saddr_t *);
+const struct identity *identity_find(const struct endpoint *, const struct datagram *,
+				const _saddr_t *ci);
+void datagram_pktinfo(struct datagram *, struct msghdr *);
+int recv_batch(struct endpoint *, size_t bsize);
+void batch_stats(int level);
+struct endpoint *demux_ep(struct endpoint *, const struct datagram *);
+ssize_t send_datagram(struct endpoint *, int fd, const void *buf, size_t len, const _saddr_t *to);
+size_t send_mcast_batch(struct endpoint **, size_t n, const void *buf, size_t len);
+int send_datagram_later(struct endpoint *, int fd, const void *buf, size_t len,
+			const _saddr_t *to, unsigned int delay);
+void sendq_drop(struct endpoint *);
+int accept_conn(struct endpoint *);
+int open_conn(struct endpoint *, int fd, const _saddr_t *);
+int conn_recv(struct conn *);
+ssize_t conn_send(struct conn *, const void *buf, size_t len, int flags);
 char *ip2uri(const char *);
+void restart_service(void);
+
+#ifdef USE_IO_URING
+// uring.c
+int uring_init(void);
+int uring_add_ep(struct endpoint *);
+void uring_del_ep(struct endpoint *);
+int uring_wait(int timeout_ms);
+void uring_exit(void);
+#endif
+
+// timer.c
+long long mono_ms(void);
+int timer_set(struct timer *, long long delay, long long period, void (*fn)(void *), void *arg);
+void timer_cancel(struct timer *);
+int timer_timeout(void);
+void timer_run(void);
+void timer_free(void);
+
+// netif.c
+const struct netif *netif_find(const struct netif_table *, unsigned int index);
+const struct netif *netif_find_name(const struct netif_table *, const char *name);
+const struct netaddr *netif_lookup(const struct netif_table *, int family,
+				const void *addr, unsigned int index);
+struct netif_db *netif_new(void);
+bool netif_update(struct netif_db *, const struct nlmsghdr *);
+int netif_load(struct netif_db *, int fd);
+int netif_resync(struct netif_db *, int fd, bool *changed);
+int netif_filter(int fd);
+int netif_publish(struct netif_db *,
+		bool (*usable)(const struct netif *, const struct netif *master));
+size_t netif_reclaim(struct netif_db *);
+const struct netif_table *netif_get(const struct netif_db *);
+void netif_online(void);
+void netif_offline(void);
+void netif_detach(void);
+int netif_match_add(struct netif_match *, const char *list);
+bool netif_match(const struct netif_match *, const char *name);
+void netif_match_free(struct netif_match *);
+void netif_free(struct netif_db *);
 
 // nl_debug.c
 int nl_debug(void *buf, int len);
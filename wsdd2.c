@@ -35,21 +35,25 @@
 #include <unistd.h> // gethostname(), getpid(), setsid(), close(), dup2()
 #include <syslog.h> // openlog()
 #include <string.h> // strncpy(), strchr(), strsignal()
+#include <strings.h> // strcasecmp()
 #include <fcntl.h> // open()
 #include <ctype.h> // isdigit(), isspace()
 #include <errno.h> // errno, ENOMEM
 #include <err.h> // err()
 #include <libgen.h> // basename()
-#include <sys/select.h> // FD_SET()
+#include <pthread.h> // pthread_create(), pthread_sigmask()
+#include <sched.h> // cpu_set_t, CPU_SET(), setns()
+#include <poll.h> // poll()
+#include <sys/epoll.h> // epoll_create1(), epoll_wait()
 #include <sys/socket.h> // SOCK_DGRAM
-#include <sys/stat.h> // stat()
+#include <sys/un.h> // struct sockaddr_un
 #include <netdb.h> // struct servent, getservbyname()
 #include <arpa/inet.h> // inet_ntop()
 #include <net/if.h> // if_indextoname()
 #include <netinet/in.h> // IPPROTO_IP
-#include <ifaddrs.h> // struct ifaddrs, getifaddrs()
 #include <linux/netlink.h> // NETLINK_ROUTE
 #include <linux/rtnetlink.h> // RTMGRP_LINK
+#include <linux/filter.h> // struct sock_fprog, SKF_AD_CPU
 
 #ifndef PAGE_SIZE
 #define PAGE_SIZE 4096 // PAGE_SIZE
@@ -57,13 +61,210 @@
 
 bool is_daemon = false;
 int debug_L, debug_W, debug_N;
-const char *hostname = NULL, *hostaliases = NULL, *netbiosname = NULL, *netbiosaliases = NULL, *workgroup = NULL;
+static const char *hostname = NULL, *hostaliases = NULL, *netbiosname = NULL, *netbiosaliases = NULL, *workgroup = NULL;
 
-static char *ifname = NULL;
-static unsigned ifindex = 0;
-static struct ifaddrs *ifaddrs_list = NULL;
+/*
+ * What we answer as: the default identity from the above, and the -P
+ * profiles, which take precedence on the interfaces and addresses they list.
+ */
+static struct identity identity;
+static struct identity *profiles;
+static size_t nprofiles;
+
+/*
+ * Interfaces selected by -i and rejected by -x. Unless -i is given, the
+ * built-in exclusions apply as well. A single interface named by -i is
+ * also ifname, which pins replies to it in every namespace.
+ */
+#define DEFAULT_EXCLUDES	"LeafNets,docker*,veth*,tun*,ppp*,zt*"
+
+static struct netif_match include_ifs, exclude_ifs, default_excludes;
+static const char *ifname = NULL;
+static bool shared_mcast = false;
+
+/* Event loops (-j), the main one included, and CPU steering for them (-c). */
+static unsigned int nloops = 1;
+static bool steer_cpu = false;
+#ifndef USE_IO_URING
+static __thread struct worker *loop_worker;	/* NULL in the main loop */
+#endif
+
+/*
+ * Network namespaces served (-n), each with an interface table and a
+ * netlink subscription of its own; the sockets of all of them are served
+ * by the same event loops. A socket is created in its namespace by
+ * switching the calling thread there with setns() for just the socket()
+ * call. "." is the namespace wsdd2 was started in, the default.
+ */
+struct netns {
+	const char *name;		/* under /run/netns unless a path */
+	char label[40];			/* " in <name>" for messages, "" for ours */
+	int fd;				/* -1 for ours */
+	unsigned int ifindex;		/* of ifname in here */
+	struct netif_db *db;
+	struct endpoint *nl_ep;
+	int dump_fd;			/* for netif_load() and netif_resync() */
+
+	/* control thread only */
+	unsigned int coalesce_events;
+	bool coalesce_resync;
+	long long coalesce_first;
+	struct timer coalesce_timer;
+	unsigned long nl_received;
+	int audit_fd;
+	unsigned long audit_seen;
+	bool audit_lost;
+	struct timer audit_timer;
+};
+
+static const char **netns_names;
+static size_t nnetns_names;
+static struct netns *netns;
+static size_t nnetns;
+static int self_netns = -1;
+
+/* socket() in namespace ns; the calling thread is back in its own after. */
+static int ns_socket(const struct netns *ns, int domain, int type, int protocol)
+{
+	int fd, _errno;
+
+	if (ns->fd < 0)
+		return socket(domain, type, protocol);
+	if (setns(ns->fd, CLONE_NEWNET))
+		return -1;
+	fd = socket(domain, type, protocol);
+	_errno = errno;
+	if (setns(self_netns, CLONE_NEWNET))
+		err(EXIT_FAILURE, "ns_socket: setns");
+	errno = _errno;
+	return fd;
+}
+
+/* Our own namespace, if it is served. */
+static struct netns *own_netns(void)
+{
+	for (size_t i = 0; i < nnetns; i++)
+		if (netns[i].fd < 0)
+			return &netns[i];
+	return NULL;
+}
+
+/*
+ * Open the namespaces to serve, on every (re)start so that one which has
+ * been recreated meanwhile is picked up. One that is missing is skipped.
+ */
+static void netns_open(void)
+{
+	static const char *const own[] = { "." };
+	const char *const *names = nnetns_names ? netns_names : own;
+	size_t n = nnetns_names ? nnetns_names : ARRAY_SIZE(own);
+
+	if (!(netns = (struct netns *) calloc(n, sizeof(*netns))))
+		err(EXIT_FAILURE, "netns_open: calloc");
+
+	for (size_t i = 0; i < n; i++) {
+		struct netns *ns = &netns[nnetns];
+
+		ns->name = names[i];
+		ns->fd = ns->dump_fd = ns->audit_fd = -1;
+		if (strcmp(ns->name, ".") != 0) {
+			char path[PATH_MAX];
+
+			if (self_netns < 0 &&
+				(self_netns = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC)) < 0)
+				err(EXIT_FAILURE, "/proc/self/ns/net");
+			snprintf(path, sizeof path, strchr(ns->name, '/') ? "%s" : "/run/netns/%s",
+				ns->name);
+			if ((ns->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+				LOG(LOG_WARNING, "network namespace %s: %s", ns->name, strerror(errno));
+				continue;
+			}
+			snprintf(ns->label, sizeof ns->label, " in %s", ns->name);
+		}
+		if (!(ns->db = netif_new()))
+			err(EXIT_FAILURE, "netns_open: netif_new");
+		nnetns++;
+	}
+}
+
+/* Once every endpoint is closed and the control thread is gone. */
+static void netns_close(void)
+{
+	for (size_t i = 0; i < nnetns; i++) {
+		struct netns *ns = &netns[i];
+
+		netif_free(ns->db);
+		if (ns->dump_fd >= 0)
+			close(ns->dump_fd);
+		if (ns->fd >= 0)
+			close(ns->fd);
+	}
+	free(netns);
+	netns = NULL;
+	nnetns = 0;
+}
+
+/*
+ * Netlink address/link events are coalesced per namespace: each one
+ * pushes the publication deadline out by the quiet period (-D), bounded
+ * by COALESCE_MAX_HOLD quiet periods after the first event of a burst.
+ * They are received and coalesced on the control thread. When events
+ * have been lost to a receive buffer overflow (its size is -R KiB), the
+ * interface table is reloaded at the deadline instead and only
+ * published if it turns out to have changed.
+ */
+#define COALESCE_MAX_HOLD	10
+#define RESYNC_RETRY_MS	1000
+
+static unsigned int coalesce_ms = 250;
+
+static unsigned int nl_rcvbuf_kb = 128;
+static unsigned long nl_overflows;
+
+static void publish_netifs(struct netns *ns);
+
+static void coalesce_apply(void *arg)
+{
+	struct netns *ns = arg;
+	bool changed = ns->coalesce_events;
+
+	DEBUG(1, W, "applying %u coalesced netlink events%s%s", ns->coalesce_events,
+		ns->coalesce_resync ? " and a resync" : "", ns->label);
+	if (ns->coalesce_resync) {
+		bool differs = false;
+
+		if (netif_resync(ns->db, ns->dump_fd, &differs)) {
+			LOG(LOG_WARNING, "%s: netlink resync%s: %s", __func__, ns->label,
+				strerror(errno));
+			timer_set(&ns->coalesce_timer, RESYNC_RETRY_MS, 0, coalesce_apply, ns);
+			return;
+		}
+		changed |= differs;
+	}
+	ns->coalesce_events = 0;
+	ns->coalesce_resync = false;
+	if (changed)
+		publish_netifs(ns);
+}
+
+/* A change was applied to the table of ns, or events were lost if resync. */
+static void coalesce_event(struct netns *ns, bool resync)
+{
+	long long now = mono_ms();
+
+	if (!ns->coalesce_events && !ns->coalesce_resync)
+		ns->coalesce_first = now;
+	if (resync)
+		ns->coalesce_resync = true;
+	else
+		ns->coalesce_events++;
+	timer_set(&ns->coalesce_timer, MIN((long long) coalesce_ms,
+			ns->coalesce_first + (long long) COALESCE_MAX_HOLD * coalesce_ms - now),
+		0, coalesce_apply, ns);
+}
 
 static int netlink_recv(struct endpoint *ep);
+static int netlink_input(struct endpoint *ep, struct datagram *dg);
 
 static struct service services[] = {
 	{
@@ -74,8 +275,11 @@ static struct service services[] = {
 		.port_num	= 3702,
 		.mcast_addr	= "239.255.255.250",
 		.init	= wsd_init,
+		.init_batch	= wsd_init_batch,
 		.recv	= wsd_recv,
+		.input	= wsd_input,
 		.exit	= wsd_exit,
+		.exit_batch	= wsd_exit_batch,
 	},
 	{
 		.name	= "wsdd-mcast-v6",
@@ -85,8 +289,11 @@ static struct service services[] = {
 		.port_num	= 3702,
 		.mcast_addr	= "ff02::c",
 		.init	= wsd_init,
+		.init_batch	= wsd_init_batch,
 		.recv	= wsd_recv,
+		.input	= wsd_input,
 		.exit	= wsd_exit,
+		.exit_batch	= wsd_exit_batch,
 	},
 	{
 		.name	= "wsdd-http-v4",
@@ -95,6 +302,7 @@ static struct service services[] = {
 		.port_name	= "wsdd",
 		.port_num	= 3702,
 		.recv	= wsd_recv,
+		.serve	= wsd_serve,
 	},
 	{
 		.name	= "wsdd-http-v6",
@@ -103,6 +311,7 @@ static struct service services[] = {
 		.port_name	= "wsdd",
 		.port_num	= 3702,
 		.recv	= wsd_recv,
+		.serve	= wsd_serve,
 	},
 	{
 		.name	= "llmnr-mcast-v4",
@@ -113,6 +322,7 @@ static struct service services[] = {
 		.mcast_addr	= "224.0.0.252",
 		.init	= llmnr_init,
 		.recv	= llmnr_recv,
+		.input	= llmnr_input,
 		.exit	= llmnr_exit,
 	},
 	{
@@ -124,6 +334,7 @@ static struct service services[] = {
 		.mcast_addr	= "ff02::1:3",
 		.init	= llmnr_init,
 		.recv	= llmnr_recv,
+		.input	= llmnr_input,
 		.exit	= llmnr_exit,
 	},
 	{
@@ -134,6 +345,7 @@ static struct service services[] = {
 		.port_num	= 5355,
 		.init	= llmnr_init,
 		.recv	= llmnr_recv,
+		.serve	= llmnr_serve,
 		.exit	= llmnr_exit,
 	},
 	{
@@ -144,6 +356,7 @@ static struct service services[] = {
 		.port_num	= 5355,
 		.init	= llmnr_init,
 		.recv	= llmnr_recv,
+		.serve	= llmnr_serve,
 		.exit	= llmnr_exit,
 	},
 	{
@@ -153,78 +366,381 @@ static struct service services[] = {
 		.protocol	= NETLINK_ROUTE,
 		.nl_groups	= RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR,
 		.recv	= netlink_recv,
+		.input	= netlink_input,
 	},
 };
 
 /*
- * Find the interface address *ci which corresponds to received message sender address *sa
- * in order to reply with the "right" IP address.
+ * Pick up the receiving interface and local address of a datagram from its
+ * IP_PKTINFO/IPV6_PKTINFO control message.
+ */
+void datagram_pktinfo(struct datagram *dg, struct msghdr *msg)
+{
+	dg->to.ss.ss_family = AF_UNSPEC;
+	dg->ifindex = 0;
+	dg->mcast = false;
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+			struct in_pktinfo pi;
+			memcpy(&pi, CMSG_DATA(cmsg), sizeof pi);
+			dg->ifindex = pi.ipi_ifindex;
+			dg->to.in.sin_family = AF_INET;
+			dg->to.in.sin_addr = pi.ipi_spec_dst;
+			dg->mcast = IN_MULTICAST(ntohl(pi.ipi_addr.s_addr));
+		} else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+			struct in6_pktinfo pi;
+			memcpy(&pi, CMSG_DATA(cmsg), sizeof pi);
+			dg->ifindex = pi.ipi6_ifindex;
+			dg->to.in6.sin6_family = AF_INET6;
+			dg->to.in6.sin6_addr = pi.ipi6_addr;
+			dg->mcast = IN6_IS_ADDR_MULTICAST(&pi.ipi6_addr);
+		}
+	}
+}
+
+/*
+ * UDP receive stage: drain up to RECV_BATCH datagrams per wakeup with
+ * recvmmsg() into a preallocated ring and hand each to the service's
+ * input handler. batch_hist[n] counts wakeups that yielded n datagrams.
  */
+#define RECV_BATCH	16
+#define RECV_BUFSIZE	10000
 
-int connected_if(const _saddr_t *sa, _saddr_t *ci)
+static __thread struct {
+	char buf[RECV_BATCH][RECV_BUFSIZE];
+	char control[RECV_BATCH][CMSG_SPACE(sizeof(struct in6_pktinfo))];
+	_saddr_t from[RECV_BATCH];
+	struct iovec iov[RECV_BATCH];
+	struct mmsghdr msgs[RECV_BATCH];
+} recv_ring;
+
+static __thread unsigned long batch_hist[RECV_BATCH + 1], batch_count;
+
+void batch_stats(int level)
 {
-	int rv = -1;
+	char line[RECV_BATCH * 24] = "", *p = line;
+
+	if (debug_W < level || !batch_count)
+		return;
+	for (size_t n = 0; n <= RECV_BATCH; n++)
+		if (batch_hist[n])
+			p += snprintf(p, line + sizeof line - p, " %zu:%lu", n, batch_hist[n]);
+	DEBUG(level, W, "recv batch sizes (%lu wakeups):%s", batch_count, line);
+}
 
-	for (struct ifaddrs *ifa = ifaddrs_list; ifa; ifa = ifa->ifa_next) {
-		const uint8_t *_if, *_nm, *_sa;
-		uint8_t *_ca;
-		size_t alen;
+int recv_batch(struct endpoint *ep, size_t bsize)
+{
+	struct endpoint *sock_ep = ep;
+
+	for (size_t i = 0; i < RECV_BATCH; i++) {
+		recv_ring.iov[i].iov_base = recv_ring.buf[i];
+		recv_ring.iov[i].iov_len = MIN(bsize, RECV_BUFSIZE) - 1;
+		recv_ring.msgs[i].msg_hdr = (struct msghdr) {
+			.msg_name = &recv_ring.from[i],
+			.msg_namelen = sizeof recv_ring.from[i],
+			.msg_iov = &recv_ring.iov[i],
+			.msg_iovlen = 1,
+			.msg_control = recv_ring.control[i],
+			.msg_controllen = sizeof recv_ring.control[i],
+		};
+	}
 
-		if (ifa->ifa_flags & IFF_SLAVE || !ifa->ifa_netmask ||
-			!ifa->ifa_addr || ifa->ifa_addr->sa_family != sa->sa.sa_family)
-			continue;
+	int n = recvmmsg(sock_ep->sock, recv_ring.msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+	if (n < 0) {
+		ep->errstr = __func__;
+		ep->_errno = errno;
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	}
 
-		if (ifindex && if_nametoindex(ifa->ifa_name) != ifindex)
-			continue;
+	batch_hist[n]++;
+	if ((++batch_count & 1023) == 0)
+		batch_stats(2);
+	DEBUG(4, W, "%s: %d datagrams", sock_ep->service->name, n);
+
+	for (int i = 0; i < n; i++) {
+		struct datagram dg = {
+			.from = recv_ring.from[i],
+			.buf = recv_ring.buf[i],
+			.len = recv_ring.msgs[i].msg_len,
+		};
+
+		datagram_pktinfo(&dg, &recv_ring.msgs[i].msg_hdr);
+		if ((ep = demux_ep(sock_ep, &dg)) && ep->service->input)
+			ep->service->input(ep, &dg);
+	}
+	return n;
+}
 
-		if (debug_W >= 4) {
-			char ifa_addr[_ADDRSTRLEN], ifa_netmask[_ADDRSTRLEN], sa_addr[_ADDRSTRLEN];
-			if (!inet_ntop(ifa->ifa_addr->sa_family, _SIN_ADDR((_saddr_t *)ifa->ifa_addr), ifa_addr, sizeof(ifa_addr)))
-				ifa_addr[0] = '\0';
-			if (!inet_ntop(sa->sa.sa_family, _SIN_ADDR(sa), ifa_netmask, sizeof(ifa_netmask)))
-				ifa_netmask[0] = '\0';
-			if (!inet_ntop(ifa->ifa_netmask->sa_family, _SIN_ADDR((_saddr_t *)ifa->ifa_netmask), sa_addr, sizeof(sa_addr)))
-				sa_addr[0] = '\0';
-			DEBUG(4, W, "%s: %s: if=%s nm=%s sc=%s", __func__, ifa->ifa_name, ifa_addr, ifa_netmask, sa_addr);
-		}
-
-		switch (sa->ss.ss_family) {
-		case AF_INET:
-			_if = (uint8_t *) &((_saddr_t *)ifa->ifa_addr)->in.sin_addr;
-			_nm = (uint8_t *) &((_saddr_t *)ifa->ifa_netmask)->in.sin_addr;
-			_sa = (uint8_t *) &sa->in.sin_addr;
-			_ca = (uint8_t *) &ci->in.sin_addr;
-			alen = sizeof(sa->in.sin_addr);
-			break;
-		case AF_INET6:
-			_if = (uint8_t *) &((_saddr_t *)ifa->ifa_addr)->in6.sin6_addr;
-			_nm = (uint8_t *) &((_saddr_t *)ifa->ifa_netmask)->in6.sin6_addr;
-			_sa = (uint8_t *) &sa->in6.sin6_addr;
-			_ca = (uint8_t *) &ci->in6.sin6_addr;
-			alen = sizeof(sa->in6.sin6_addr);
-			break;
-		default:
-			continue;
+union pktinfo_control {
+	char buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+	struct cmsghdr align;
+};
+
+/*
+ * Steer msg out of ep's interface. An IPv4 source would otherwise be
+ * picked by route, which may be another interface's address; an IPv6 one
+ * is picked among the outgoing interface's own.
+ */
+static void set_pktinfo(struct msghdr *msg, union pktinfo_control *control,
+			const struct endpoint *ep)
+{
+	memset(control, 0, sizeof(*control));
+	msg->msg_control = control->buf;
+
+	struct cmsghdr *cmsg = (struct cmsghdr *) control->buf;
+	if (ep->family == AF_INET) {
+		struct in_pktinfo pi = {
+			.ipi_ifindex = ep->ifindex,
+#ifdef USE_ip_mreq
+			.ipi_spec_dst = ep->mreq.ip_mreq.imr_interface,
+#else
+			.ipi_spec_dst = ep->mreq.ip_mreq.imr_address,
+#endif
+		};
+		msg->msg_controllen = CMSG_SPACE(sizeof pi);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof pi);
+		memcpy(CMSG_DATA(cmsg), &pi, sizeof pi);
+	} else {
+		struct in6_pktinfo pi = { .ipi6_ifindex = ep->ifindex };
+		msg->msg_controllen = CMSG_SPACE(sizeof pi);
+		cmsg->cmsg_level = IPPROTO_IPV6;
+		cmsg->cmsg_type = IPV6_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof pi);
+		memcpy(CMSG_DATA(cmsg), &pi, sizeof pi);
+	}
+}
+
+/*
+ * Send one datagram. Multicast leaves through ep's own interface by way of
+ * IP_PKTINFO/IPV6_PKTINFO, so endpoints sharing a socket need no
+ * per-socket IP_MULTICAST_IF.
+ */
+ssize_t send_datagram(struct endpoint *ep, int fd, const void *buf, size_t len,
+			const _saddr_t *to)
+{
+	union pktinfo_control control;
+	struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+	struct msghdr msg = {
+		.msg_name = (void *) to,
+		.msg_namelen = (to->ss.ss_family == AF_INET) ? sizeof to->in : sizeof to->in6,
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	if (ep->ifindex && (to->ss.ss_family == AF_INET ?
+			IN_MULTICAST(ntohl(to->in.sin_addr.s_addr)) :
+			IN6_IS_ADDR_MULTICAST(&to->in6.sin6_addr)))
+		set_pktinfo(&msg, &control, ep);
+
+	return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+/*
+ * Send buf to the multicast group of every endpoint in eps[], which all
+ * belong to the same service. Each run of endpoints in one namespace and
+ * VRF goes out of the socket of its first in sendmmsg() batches, each message
+ * steered to its endpoint's interface with pktinfo. Returns the number
+ * of endpoints it failed for.
+ */
+#define SEND_BATCH	64
+
+size_t send_mcast_batch(struct endpoint **eps, size_t n, const void *buf, size_t len)
+{
+	struct mmsghdr msgs[SEND_BATCH];
+	union pktinfo_control control[SEND_BATCH];
+	struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+	size_t failed = 0, batches = 0;
+
+	for (size_t i = 0; i < n;) {
+		size_t m = MIN(n - i, SEND_BATCH);
+
+		for (size_t k = 1; k < m; k++)
+			if (eps[i + k]->ns != eps[i]->ns || eps[i + k]->vrf != eps[i]->vrf)
+				m = k;
+		for (size_t k = 0; k < m; k++) {
+			const struct endpoint *ep = eps[i + k];
+			msgs[k].msg_hdr = (struct msghdr) {
+				.msg_name = (void *) &ep->mcast,
+				.msg_namelen = ep->mlen,
+				.msg_iov = &iov,
+				.msg_iovlen = 1,
+			};
+			set_pktinfo(&msgs[k].msg_hdr, &control[k], ep);
 		}
 
-		rv = 0;
-		for (size_t i = 0; i < alen; i++) {
-			if ((_if[i] & _nm[i]) != (_sa[i] & _nm[i])) {
-				rv = -1;
-				break;
-			}
+		int sent = sendmmsg(eps[i]->sock, msgs, m, MSG_NOSIGNAL);
+		batches++;
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0) {
+			/* The first message failed; report it and go on after it. */
+			eps[i]->errstr = __func__;
+			eps[i]->_errno = errno;
+			DEBUG(1, W, "%s @ %s: %s: %s", eps[i]->service->name, eps[i]->ifname,
+				eps[i]->errstr, strerror(errno));
+			failed++;
+			i++;
+			continue;
 		}
-		if (!rv) {
-			ci->ss.ss_family = sa->ss.ss_family;
-			memcpy(_ca, _if, alen);
+		i += sent;
+	}
+
+	DEBUG(3, W, "%s: %zu endpoints, %zu batches, %zu failed",
+		eps[0]->service->name, n, batches, failed);
+	return failed;
+}
+
+/*
+ * Deferred sends: a reply that has to wait out its random delay is copied
+ * here and sent by a one-shot timer, so the event loop never sleeps.
+ * At most SENDQ_MAX replies are pending; anything beyond is dropped, as a
+ * late reply is worth no more than a lost one.
+ */
+#define SENDQ_MAX	256
+
+struct deferred {
+	struct timer timer;
+	struct endpoint *ep;
+	int fd;
+	_saddr_t to;
+	struct deferred *next;
+	size_t len;
+	char buf[];
+};
+
+static __thread struct deferred *sendq;
+static __thread unsigned int nsendq;
+
+static void sendq_unlink(struct deferred *d)
+{
+	for (struct deferred **pp = &sendq; *pp; pp = &(*pp)->next) {
+		if (*pp == d) {
+			*pp = d->next;
+			nsendq--;
 			break;
 		}
 	}
+	timer_cancel(&d->timer);
+	free(d);
+}
+
+static void sendq_fire(void *arg)
+{
+	struct deferred *d = arg;
+
+	if (send_datagram(d->ep, d->fd, d->buf, d->len, &d->to) != (ssize_t) d->len)
+		DEBUG(1, W, "%s @ %s: deferred send: %s",
+			d->ep->service->name, d->ep->ifname, strerror(errno));
+	sendq_unlink(d);
+}
+
+int send_datagram_later(struct endpoint *ep, int fd, const void *buf, size_t len,
+			const _saddr_t *to, unsigned int delay)
+{
+	struct deferred *d;
+
+	if (nsendq >= SENDQ_MAX || !(d = calloc(1, sizeof *d + len))) {
+		DEBUG(1, W, "%s @ %s: send queue full, reply dropped",
+			ep->service->name, ep->ifname);
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	d->ep = ep;
+	d->fd = fd;
+	d->to = *to;
+	d->len = len;
+	memcpy(d->buf, buf, len);
+	if (timer_set(&d->timer, delay, 0, sendq_fire, d)) {
+		free(d);
+		errno = ENOMEM;
+		return -1;
+	}
+	d->next = sendq;
+	sendq = d;
+	nsendq++;
+	return 0;
+}
+
+/* Discard the pending replies of ep, or of every endpoint if ep is NULL. */
+void sendq_drop(struct endpoint *ep)
+{
+	for (struct deferred *d = sendq, *next; d; d = next) {
+		next = d->next;
+		if (!ep || d->ep == ep)
+			sendq_unlink(d);
+	}
+}
+
+/* The link dg came in on, 0 if unknown. */
+static unsigned int rx_ifindex(const struct endpoint *ep, const struct datagram *dg)
+{
+	/* Some kernels give the VRF device for a datagram received on its port. */
+	if (dg->ifindex && dg->ifindex == ep->vrf && ep->ifindex)
+		return ep->ifindex;
+	return dg->ifindex;
+}
+
+/*
+ * Find the interface address *ci which corresponds to received message sender address *sa
+ * in order to reply with the "right" IP address.
+ */
+int connected_if(const struct endpoint *ep, const struct datagram *dg, _saddr_t *ci)
+{
+	const _saddr_t *sa = &dg->from;
+	const struct netaddr *found;
+	unsigned int ifindex = rx_ifindex(ep, dg);
+	int rv = -1;
+
+	if (sa->ss.ss_family != AF_INET && sa->ss.ss_family != AF_INET6) {
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+
+	/*
+	 * Unicast destination (or IPv4 ipi_spec_dst): the kernel has already
+	 * picked the address the sender reached us on.
+	 */
+	if (dg->to.ss.ss_family == sa->ss.ss_family &&
+		!(dg->to.ss.ss_family == AF_INET ?
+			IN_MULTICAST(ntohl(dg->to.in.sin_addr.s_addr)) ||
+			dg->to.in.sin_addr.s_addr == htonl(INADDR_ANY) :
+			IN6_IS_ADDR_MULTICAST(&dg->to.in6.sin6_addr) ||
+			IN6_IS_ADDR_UNSPECIFIED(&dg->to.in6.sin6_addr))) {
+		*ci = dg->to;
+		rv = 0;
+		goto out;
+	}
+
+	/* Only the receiving interface's addresses if it is known. */
+	const struct netif_table *t = netif_get(ep->ns->db);
+	found = netif_lookup(t, sa->ss.ss_family, _SIN_ADDR(sa),
+		ifindex ? ifindex : ep->ns->ifindex);
+
+	/* A routed sender still gets an address of the interface it used. */
+	for (size_t i = 0; !found && ifindex && i < t->naddrs; i++) {
+		const struct netaddr *na = &t->addrs[i];
+		if (na->family == sa->ss.ss_family && na->index == ifindex)
+			found = na;
+	}
+
+	if (found) {
+		ci->ss.ss_family = sa->ss.ss_family;
+		memcpy(_SIN_ADDR(ci), &found->addr, sa->ss.ss_family == AF_INET ?
+			sizeof(ci->in.sin_addr) : sizeof(ci->in6.sin6_addr));
+		rv = 0;
+	}
 
+out:
 	if (debug_W >= 4) {
-		char name[_ADDRSTRLEN];
-		if (inet_ntop(ci->ss.ss_family, _SIN_ADDR(ci), name, sizeof(name)))
-			DEBUG(4, W, "%s: ci=%s rv=%d", __func__, name, rv);
+		char name[_ADDRSTRLEN], from[_ADDRSTRLEN];
+		if (inet_ntop(ci->ss.ss_family, _SIN_ADDR(ci), name, sizeof(name)) &&
+			inet_ntop(sa->ss.ss_family, _SIN_ADDR(sa), from, sizeof(from)))
+			DEBUG(4, W, "%s: sc=%s ci=%s ifindex=%u rv=%d", __func__,
+				from, name, ifindex, rv);
 	}
 
 	if (rv) errno = ENONET;
@@ -249,123 +765,567 @@ char *ip2uri(const char *ip)
 }
 
 static struct endpoint *endpoints;
+#ifndef USE_IO_URING
+static __thread int epoll_fd = -1;
 
-static const struct sock_params {
-	int family;
-	const char *name;
-	int ipproto_ip;
-	int ip_multicast_loop;
-	int ip_add_membership;
-	int ip_drop_membership;
-	int ip_pktinfo;
-	size_t llen, mlen, mreqlen;
-} sock_params[] = {
-	[AF_INET] = {
-		.family			= AF_INET,
-		.name			= "IPv4",
-		.ipproto_ip		= IPPROTO_IP,
-		.ip_multicast_loop	= IP_MULTICAST_LOOP,
-		.ip_add_membership	= IP_ADD_MEMBERSHIP,
-		.ip_drop_membership	= IP_DROP_MEMBERSHIP,
-		.ip_pktinfo		= IP_PKTINFO,
-		.llen			= sizeof(struct sockaddr_in),
-		.mlen			= sizeof(struct sockaddr_in),
-		.mreqlen		= sizeof(endpoints[0].mreq.ip_mreq),
-	},
-	[AF_INET6] = {
-		.family			= AF_INET6,
-		.name			= "IPv6",
-		.ipproto_ip		= IPPROTO_IPV6,
-		.ip_multicast_loop	= IPV6_MULTICAST_LOOP,
-		.ip_add_membership	= IPV6_ADD_MEMBERSHIP,
-		.ip_drop_membership	= IPV6_DROP_MEMBERSHIP,
-		.ip_pktinfo		= IPV6_RECVPKTINFO,
-		.llen			= sizeof(struct sockaddr_in6),
-		.mlen			= sizeof(struct sockaddr_in6),
-		.mreqlen		= sizeof(endpoints[0].mreq.ipv6_mreq),
-	},
-	[AF_NETLINK] = {
-		.family			= AF_NETLINK,
-		.name			= "NETLINK",
-		.llen			= sizeof(struct sockaddr_nl),
-	},
-};
-
-static const char *const socktype_str[] = {
-	[SOCK_STREAM]    = "tcp",
-	[SOCK_DGRAM]     = "udp",
-	[SOCK_SEQPACKET] = "seq",
-};
+#define EPOLL_MAX_EVENTS	64
+#endif
 
-static int open_ep(struct endpoint **epp, struct service *sv, const struct ifaddrs *ifa)
+/*
+ * Route a datagram received on a shared multicast socket to the endpoint
+ * of its receiving interface. NULL if that interface is not served.
+ */
+struct endpoint *demux_ep(struct endpoint *ep, const struct datagram *dg)
 {
-#define __FUNCTION__	"open_ep"
-	const unsigned int disable = 0, enable = 1;
-
-	struct endpoint *ep = (struct endpoint *) calloc(sizeof(*ep), 1);
-	if ((*epp = ep) == NULL) {
-		errno = ENOMEM;
-		err(EXIT_FAILURE, __FUNCTION__ ": calloc");
+	if (!ep->shared)
+		return ep;
+
+	for (size_t lo = 0, hi = ep->members; lo < hi;) {
+		size_t mid = lo + (hi - lo) / 2;
+		struct endpoint *e = ep->member[mid];
+
+		if (e->ifindex == dg->ifindex)
+			return e;
+		if (e->ifindex < dg->ifindex)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	strncpy(ep->ifname, ifa->ifa_name, sizeof(ep->ifname));
-	ep->service = sv;
-	ep->family = sv->family;
-	ep->type = sv->type;
-	ep->protocol = sv->protocol;
+	DEBUG(3, W, "%s: dropped datagram from ifindex %u", ep->service->name, dg->ifindex);
+	return NULL;
+}
 
-	if (sv->family >= (int) ARRAY_SIZE(sock_params) || !sock_params[ep->family].name) {
-		ep->errstr = __FUNCTION__ ": Unsupported address family";
-		ep->_errno = EINVAL;
+/*
+ * Link endpoint into the active list and register its socket with epoll.
+ * The endpoint itself is the epoll cookie so a ready event dispatches
+ * straight to its service without scanning the list.
+ */
+static int poll_ep(struct endpoint *ep)
+{
+#ifdef USE_IO_URING
+	return uring_add_ep(ep);
+#else
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = ep,
+	};
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ep->sock, &ev)) {
+		ep->errstr = "poll_ep: epoll_ctl";
+		ep->_errno = errno;
 		return -1;
 	}
+	return 0;
+#endif
+}
 
-	if (sv->family == AF_INET || sv->family == AF_INET6) {
-		struct servent *se = getservbyname(sv->port_name, socktype_str[sv->type]);
-		ep->port = se ? ntohs(se->s_port) : 0;
-		if (!ep->port)
-			ep->port = sv->port_num;
-		if (!ep->port) {
-			ep->errstr = __FUNCTION__ ": No port number";
-			ep->_errno = EADDRNOTAVAIL;
-			return -1;
-		}
-	}
+static int add_ep(struct endpoint *ep)
+{
+	/* The shared socket is polled once, for all members. */
+	if (!ep->group && poll_ep(ep))
+		return -1;
 
-	const struct sock_params *sp = &sock_params[ep->family];
+	ep->next = endpoints;
+	endpoints = ep;
+	return 0;
+}
 
-	ep->mcast.ss.ss_family = ep->family;
-	ep->mlen = sp->mlen;
+/*
+ * Detach an endpoint that has already been unlinked from the active list
+ * from the event loop, so that no pending event refers to it any more.
+ */
+static void del_ep(struct endpoint *ep)
+{
+	if (ep->group)
+		return;
+#ifdef USE_IO_URING
+	uring_del_ep(ep);
+#else
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ep->sock, NULL);
+#endif
+}
 
-	ep->local.ss.ss_family = ep->family;
-	ep->llen = sp->llen;
+/*
+ * Accepted TCP connections are non-blocking and read from the event loop
+ * as data arrives; each has CONN_TIMEOUT msec to deliver a complete
+ * request. At most CONN_MAX are open at a time, further ones are refused.
+ */
+#define CONN_MAX	32
+#define CONN_TIMEOUT	1000
 
-	ep->mreqlen = sp->mreqlen;
+static __thread struct conn *conns;
+static __thread unsigned int nconns;
 
-	switch (ep->family) {
-	case AF_INET:
-		if (sv->mcast_addr) {
-			ep->mcast.in.sin_port = htons(ep->port);
-			if (inet_pton(ep->family, sv->mcast_addr, &ep->mcast.in.sin_addr.s_addr) != 1) {
-				ep->errstr = __FUNCTION__ ": Bad mcast IP addr";
-				ep->_errno = errno;
-				return -1;
-			}
-			ep->mreq.ip_mreq.imr_multiaddr = ep->mcast.in.sin_addr;
+static void close_conn(struct conn *c)
+{
+	struct conn **cp;
+
+	timer_cancel(&c->timeout);
+	for (cp = &conns; *cp != c; cp = &(*cp)->next)
+		;
+	*cp = c->next;
+	nconns--;
+
+	del_ep(&c->ep);
+	close(c->ep.sock);
+	free(c->out);
+	free(c);
+}
+
+static void expire_conn(void *arg)
+{
+	struct conn *c = arg;
+
+	DEBUG(1, W, "%s: connection fd=%d timed out", c->ep.service->name, c->ep.sock);
+	close_conn(c);
+}
+
+int accept_conn(struct endpoint *ep)
+{
+	_saddr_t sa;
+	socklen_t slen = sizeof sa;
+	int fd = accept4(ep->sock, &sa.sa, &slen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+	if (fd < 0) {
+		if (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED)
+			return 0;
+		ep->errstr = "accept_conn: accept";
+		ep->_errno = errno;
+		return -1;
+	}
+
+	return open_conn(ep, fd, &sa);
+}
+
+static bool addr_equal(const struct netaddr *na, int family, const void *addr)
+{
+	return na->family == family && memcmp(&na->addr, addr, family == AF_INET ?
+		sizeof(na->addr.in) : sizeof(na->addr.in6)) == 0;
+}
+
+/*
+ * A listener passed in by systemd is bound to any address, so -i and -x
+ * are applied to its connections instead: only those to an address of a
+ * usable link, i.e. one in the snapshot, are served.
+ */
+static bool conn_usable(const struct endpoint *ep, const _saddr_t *to)
+{
+	const struct netif_table *t = netif_get(ep->ns->db);
+
+	for (size_t i = 0; i < t->naddrs; i++)
+		if (addr_equal(&t->addrs[i], to->ss.ss_family, _SIN_ADDR(to)))
+			return true;
+	return false;
+}
+
+/*
+ * Take over non-blocking connection fd accepted on listening endpoint ep.
+ */
+int open_conn(struct endpoint *ep, int fd, const _saddr_t *sa)
+{
+	if (nconns >= CONN_MAX) {
+		DEBUG(1, W, "%s: %u connections open, refusing another",
+			ep->service->name, nconns);
+		close(fd);
+		return 0;
+	}
+
+	_saddr_t to;
+	socklen_t slen = sizeof to;
+	if (getsockname(fd, &to.sa, &slen))
+		to.ss.ss_family = AF_UNSPEC;
+
+	if (ep->activated && !conn_usable(ep, &to)) {
+		char ip[_ADDRSTRLEN];
+		DEBUG(2, W, "%s: connection to %s refused: interface not selected",
+			ep->service->name, to.ss.ss_family == AF_UNSPEC ? "?" :
+			inet_ntop(to.ss.ss_family, _SIN_ADDR(&to), ip, sizeof ip));
+		close(fd);
+		return 0;
+	}
+
+	struct conn *c = (struct conn *) malloc(sizeof(*c));
+	if (!c) {
+		close(fd);
+		return 0;
+	}
+
+	c->ep = *ep;
+	c->ep.sock = fd;
+	c->ep.next = NULL;
+	c->ep.conn = c;
+	c->from = *sa;
+	c->to = to;
+	memset(&c->ep.timer, 0, sizeof(c->ep.timer));
+	memset(&c->timeout, 0, sizeof(c->timeout));
+	c->armed = false;
+	c->len = 0;
+	c->out = NULL;
+	c->outlen = c->outoff = 0;
+
+	if (poll_ep(&c->ep)) {
+		LOG(LOG_WARNING, "%s: open_conn: %s", ep->service->name, strerror(errno));
+		close(fd);
+		free(c);
+		return 0;
+	}
+
+	c->next = conns;
+	conns = c;
+	nconns++;
+	timer_set(&c->timeout, CONN_TIMEOUT, 0, expire_conn, c);
+	DEBUG(3, W, "%s: connection fd=%d opened (%u open)", ep->service->name, fd, nconns);
+	return 0;
+}
+
+/*
+ * Send buf on c, or queue what the socket does not take now behind what
+ * is queued already. Returns len, or -1 if the connection failed.
+ */
+ssize_t conn_send(struct conn *c, const void *buf, size_t len, int flags)
+{
+	ssize_t sent = 0;
+
+	if (c->outoff == c->outlen) {
+		sent = send(c->ep.sock, buf, len, flags | MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent < 0 && errno != EAGAIN && errno != EINTR)
+			return -1;
+		if (sent < 0)
+			sent = 0;
+		if ((size_t) sent == len)
+			return len;
+	}
+
+	char *out = realloc(c->out, c->outlen + len - sent);
+	if (!out)
+		return -1;
+	memcpy(out + c->outlen, (const char *) buf + sent, len - sent);
+	c->out = out;
+	c->outlen += len - sent;
+	return len;
+}
+
+/* Send what is queued on c. Returns 1 while some is left, 0 if none, -1 on error. */
+static int conn_flush(struct conn *c)
+{
+	while (c->outoff < c->outlen) {
+		ssize_t sent = send(c->ep.sock, c->out + c->outoff, c->outlen - c->outoff,
+				MSG_NOSIGNAL | MSG_DONTWAIT);
+
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent < 0 && errno == EAGAIN)
+			return 1;
+		if (sent < 0) {
+			DEBUG(1, W, "%s: send: %s", c->ep.service->name, strerror(errno));
+			return -1;
+		}
+		c->outoff += sent;
+	}
+	return 0;
+}
+
+/* Poll c for writing, which the io_uring backend does by itself while c->out is set. */
+static int conn_poll_out(struct conn *c)
+{
+#ifdef USE_IO_URING
+	(void) c; // silent "unused" warning
+	return 0;
+#else
+	struct epoll_event ev = {
+		.events = EPOLLOUT,
+		.data.ptr = &c->ep,
+	};
+
+	return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->ep.sock, &ev);
+#endif
+}
+
+/*
+ * Read what has arrived on c and let the service look at it, or go on
+ * sending its reply. Returns 1 while the connection stays open, 0 once
+ * it has been closed.
+ */
+int conn_recv(struct conn *c)
+{
+	if (c->out) {
+		if (conn_flush(c) > 0)
+			return 1;
+		DEBUG(3, W, "%s: connection fd=%d closed", c->ep.service->name, c->ep.sock);
+		close_conn(c);
+		return 0;
+	}
+
+	ssize_t len = recv(c->ep.sock, c->buf + c->len, sizeof(c->buf) - 1 - c->len, 0);
+
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return 1;
+
+	if (len > 0) {
+		c->len += len;
+		c->buf[c->len] = '\0';
+		if (c->ep.service->serve(c) > 0) {
+			if (c->len < sizeof(c->buf) - 1)
+				return 1;
+			DEBUG(1, W, "%s: request too large", c->ep.service->name);
+		}
+	} else if (len < 0) {
+		DEBUG(1, W, "%s: recv: %s", c->ep.service->name, strerror(errno));
+	}
+
+	/* The rest of the reply goes out as the peer makes room for it. */
+	if (c->out && conn_flush(c) > 0 && !conn_poll_out(c)) {
+		timer_set(&c->timeout, CONN_TIMEOUT, 0, expire_conn, c);
+		return 1;
+	}
+
+	DEBUG(3, W, "%s: connection fd=%d closed", c->ep.service->name, c->ep.sock);
+	close_conn(c);
+	return 0;
+}
+
+/* Drop every connection at once, as the event loop goes away. */
+static void close_conns(void)
+{
+	while (conns) {
+		struct conn *c = conns;
+		conns = c->next;
+		close(c->ep.sock);
+		free(c->out);
+		free(c);
+	}
+	nconns = 0;
+}
+
+static const struct sock_params {
+	int family;
+	const char *name;
+	int ipproto_ip;
+	int ip_multicast_loop;
+	int ip_add_membership;
+	int ip_drop_membership;
+	int ip_pktinfo;
+	size_t llen, mlen, mreqlen;
+} sock_params[] = {
+	[AF_INET] = {
+		.family			= AF_INET,
+		.name			= "IPv4",
+		.ipproto_ip		= IPPROTO_IP,
+		.ip_multicast_loop	= IP_MULTICAST_LOOP,
+		.ip_add_membership	= IP_ADD_MEMBERSHIP,
+		.ip_drop_membership	= IP_DROP_MEMBERSHIP,
+		.ip_pktinfo		= IP_PKTINFO,
+		.llen			= sizeof(struct sockaddr_in),
+		.mlen			= sizeof(struct sockaddr_in),
+		.mreqlen		= sizeof(endpoints[0].mreq.ip_mreq),
+	},
+	[AF_INET6] = {
+		.family			= AF_INET6,
+		.name			= "IPv6",
+		.ipproto_ip		= IPPROTO_IPV6,
+		.ip_multicast_loop	= IPV6_MULTICAST_LOOP,
+		.ip_add_membership	= IPV6_ADD_MEMBERSHIP,
+		.ip_drop_membership	= IPV6_DROP_MEMBERSHIP,
+		.ip_pktinfo		= IPV6_RECVPKTINFO,
+		.llen			= sizeof(struct sockaddr_in6),
+		.mlen			= sizeof(struct sockaddr_in6),
+		.mreqlen		= sizeof(endpoints[0].mreq.ipv6_mreq),
+	},
+	[AF_NETLINK] = {
+		.family			= AF_NETLINK,
+		.name			= "NETLINK",
+		.llen			= sizeof(struct sockaddr_nl),
+	},
+};
+
+static const char *const socktype_str[] = {
+	[SOCK_STREAM]    = "tcp",
+	[SOCK_DGRAM]     = "udp",
+	[SOCK_SEQPACKET] = "seq",
+};
+
+/* The port of sv from the services database, else its built-in one. */
+static in_port_t service_port(const struct service *sv)
+{
+	struct servent *se = getservbyname(sv->port_name, socktype_str[sv->type]);
+
+	return se ? ntohs(se->s_port) : sv->port_num;
+}
+
+/* Add ep to the members of shared socket group, kept sorted for demux_ep(). */
+static void group_add(struct endpoint *group, struct endpoint *ep)
+{
+	if (group->members == group->members_cap) {
+		unsigned int cap = group->members_cap ? group->members_cap * 2 : 8;
+		struct endpoint **member = realloc(group->member, cap * sizeof(*member));
+
+		if (!member)
+			err(EXIT_FAILURE, "group_add: realloc");
+		group->member = member;
+		group->members_cap = cap;
+	}
+
+	unsigned int i = group->members++;
+	for (; i > 0 && group->member[i - 1]->ifindex > ep->ifindex; i--)
+		group->member[i] = group->member[i - 1];
+	group->member[i] = ep;
+}
+
+static void group_del(struct endpoint *group, struct endpoint *ep)
+{
+	for (unsigned int i = 0; i < group->members; i++) {
+		if (group->member[i] == ep) {
+			memmove(&group->member[i], &group->member[i + 1],
+				(--group->members - i) * sizeof(*group->member));
+			break;
+		}
+	}
+}
+
+/* The VRF device ifp is enslaved to, if any. */
+static const struct netif *vrf_master(const struct netif_table *t, const struct netif *ifp)
+{
+	const struct netif *master = ifp && ifp->master ? netif_find(t, ifp->master) : NULL;
+
+	return master && strcmp(master->kind, "vrf") == 0 ? master : NULL;
+}
+
+/* Whether m names ifp or the VRF it is in, if vrf. */
+static bool link_match(const struct netif_match *m, const struct netif *ifp,
+			const struct netif *vrf)
+{
+	return netif_match(m, ifp->name) || (vrf && netif_match(m, vrf->name));
+}
+
+/*
+ * The identity for address addr (NULL if unknown) on link ifp of table t:
+ * a profile listing the address, else the first one matching the link or
+ * its VRF, else the default one.
+ */
+static const struct identity *identity_match(const struct netif_table *t,
+			const struct netif *ifp, int family, const void *addr)
+{
+	for (size_t i = 0; addr && i < nprofiles; i++)
+		for (size_t k = 0; k < profiles[i].naddrs; k++)
+			if (addr_equal(&profiles[i].addrs[k], family, addr))
+				return &profiles[i];
+
+	for (size_t i = 0; ifp && i < nprofiles; i++)
+		if (link_match(&profiles[i].ifs, ifp, vrf_master(t, ifp)))
+			return &profiles[i];
+
+	return &identity;
+}
+
+/*
+ * The identity to answer the request in dg with, ci being the address we
+ * answer from (NULL if unknown). A connection has no receiving link, so
+ * its local address names it.
+ */
+const struct identity *identity_find(const struct endpoint *ep, const struct datagram *dg,
+				const _saddr_t *ci)
+{
+	if (!nprofiles)
+		return &identity;
+
+	const struct netif_table *t = netif_get(ep->ns->db);
+	unsigned int ifindex = rx_ifindex(ep, dg);
+	int family = ci ? ci->ss.ss_family : AF_UNSPEC;
+	const void *addr = family == AF_INET || family == AF_INET6 ? _SIN_ADDR(ci) : NULL;
+
+	for (size_t i = 0; !ifindex && addr && i < t->naddrs; i++)
+		if (addr_equal(&t->addrs[i], family, addr))
+			ifindex = t->addrs[i].index;
+	if (!ifindex)
+		ifindex = ep->ifindex;
+
+	return identity_match(t, netif_find(t, ifindex), family, addr);
+}
+
+/*
+ * Open an endpoint for service sv on interface ifp/address na of
+ * namespace ns. A member of a shared multicast socket (group != NULL)
+ * only joins the group on group's socket; the shared socket itself is
+ * opened with ifp == NULL.
+ */
+static int open_ep(struct endpoint **epp, struct netns *ns, struct service *sv,
+			const struct netif *ifp, const struct netaddr *na,
+			struct endpoint *group)
+{
+#define __FUNCTION__	"open_ep"
+	const unsigned int disable = 0, enable = 1;
+	const struct netif_table *t = netif_get(ns->db);
+	const struct netif *vrf = vrf_master(t, ifp);
+
+	struct endpoint *ep = (struct endpoint *) calloc(sizeof(*ep), 1);
+	if ((*epp = ep) == NULL) {
+		errno = ENOMEM;
+		err(EXIT_FAILURE, __FUNCTION__ ": calloc");
+	}
+
+	if (ifp) {
+		strncpy(ep->ifname, ifp->name, sizeof(ep->ifname));
+		ep->ifindex = ifp->index;
+	}
+	if (vrf)
+		ep->vrf = vrf->index;
+	ep->identity = identity_match(t, ifp, na ? na->family : AF_UNSPEC,
+				na ? &na->addr : NULL);
+	ep->ns = ns;
+	ep->service = sv;
+	ep->family = sv->family;
+	ep->type = sv->type;
+	ep->protocol = sv->protocol;
+
+	if (sv->family >= (int) ARRAY_SIZE(sock_params) || !sock_params[ep->family].name) {
+		ep->errstr = __FUNCTION__ ": Unsupported address family";
+		ep->_errno = EINVAL;
+		return -1;
+	}
+
+	if (sv->family == AF_INET || sv->family == AF_INET6) {
+		ep->port = service_port(sv);
+		if (!ep->port) {
+			ep->errstr = __FUNCTION__ ": No port number";
+			ep->_errno = EADDRNOTAVAIL;
+			return -1;
+		}
+	}
+
+	const struct sock_params *sp = &sock_params[ep->family];
+
+	ep->mcast.ss.ss_family = ep->family;
+	ep->mlen = sp->mlen;
+
+	ep->local.ss.ss_family = ep->family;
+	ep->llen = sp->llen;
+
+	ep->mreqlen = sp->mreqlen;
+
+	switch (ep->family) {
+	case AF_INET:
+		if (sv->mcast_addr && ifp) {
+			ep->mcast.in.sin_port = htons(ep->port);
+			if (inet_pton(ep->family, sv->mcast_addr, &ep->mcast.in.sin_addr.s_addr) != 1) {
+				ep->errstr = __FUNCTION__ ": Bad mcast IP addr";
+				ep->_errno = errno;
+				return -1;
+			}
+			ep->mreq.ip_mreq.imr_multiaddr = ep->mcast.in.sin_addr;
 #ifdef USE_ip_mreq
-			ep->mreq.ip_mreq.imr_interface = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+			ep->mreq.ip_mreq.imr_interface = na->addr.in;
 #else
-			ep->mreq.ip_mreq.imr_address = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
-			ep->mreq.ip_mreq.imr_ifindex = if_nametoindex(ep->ifname);
+			ep->mreq.ip_mreq.imr_address = na->addr.in;
+			ep->mreq.ip_mreq.imr_ifindex = ep->ifindex;
 #endif
 		}
-		//ep->local.saddr_in = *(struct sockaddr_in *)ifa->ifa_addr;
 		ep->local.in.sin_addr.s_addr = htonl(INADDR_ANY);
 		ep->local.in.sin_port = htons(ep->port);
 		break;
 
 	case AF_INET6:
-		if (sv->mcast_addr) {
+		if (sv->mcast_addr && ifp) {
 			ep->mcast.in6.sin6_port = htons(ep->port);
 			if (inet_pton(ep->family, sv->mcast_addr, ep->mcast.in6.sin6_addr.s6_addr) != 1) {
 				ep->errstr = __FUNCTION__ ": Bad mcast IPv6 addr";
@@ -373,20 +1333,26 @@ static int open_ep(struct endpoint **epp, struct service *sv, const struct ifadd
 				return -1;
 			}
 			ep->mreq.ipv6_mreq.ipv6mr_multiaddr = ep->mcast.in6.sin6_addr;
-			ep->mreq.ipv6_mreq.ipv6mr_interface = if_nametoindex(ep->ifname);
+			ep->mreq.ipv6_mreq.ipv6mr_interface = ep->ifindex;
 		}
-		//ep->local.in6 = *(struct sockaddr_in6 *)ifa->ifa_addr;
 		ep->local.in6.sin6_addr = in6addr_any;
 		ep->local.in6.sin6_port = htons(ep->port);
 		break;
 
 	case AF_NETLINK:
-		ep->local.nl.nl_pid = getpid();
+		/* Elsewhere our pid may well be somebody else's port id. */
+		ep->local.nl.nl_pid = ns->fd < 0 ? getpid() : 0;
 		ep->local.nl.nl_groups = ep->service->nl_groups;
 		break;
 	}
 
-	ep->sock = socket(ep->family, ep->type | SOCK_CLOEXEC, ep->protocol);
+	if (group) {
+		ep->group = group;
+		ep->sock = group->sock;
+		goto join;
+	}
+
+	ep->sock = ns_socket(ns, ep->family, ep->type | SOCK_CLOEXEC, ep->protocol);
 	if (ep->sock < 0) {
 		ep->errstr = __FUNCTION__ ": Can't open socket";
 		ep->_errno = errno;
@@ -398,10 +1364,12 @@ static int open_ep(struct endpoint **epp, struct service *sv, const struct ifadd
 	setsockopt(ep->sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof enable);
 #endif
 #ifdef SO_RCVBUFFORCE
-	int rcvbuf = 128 * 1024;
+	int rcvbuf = nl_rcvbuf_kb * 1024;
 	if ((ep->family == AF_NETLINK) &&
 		setsockopt(ep->sock, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof rcvbuf)) {
 		LOG(LOG_WARNING, "%s: SO_RCVBUFFORCE: %s", __FUNCTION__, strerror(errno));
+		/* Without CAP_NET_ADMIN, as much as net.core.rmem_max allows */
+		setsockopt(ep->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
 	}
 #endif
 #ifdef IPV6_V6ONLY
@@ -414,8 +1382,14 @@ static int open_ep(struct endpoint **epp, struct service *sv, const struct ifadd
 	}
 #endif
 #ifdef SO_BINDTODEVICE
-	if (!sv->mcast_addr && (ep->family == AF_INET || ep->family == AF_INET6)) {
-		if (setsockopt(ep->sock, SOL_SOCKET, SO_BINDTODEVICE, ep->ifname, strlen(ep->ifname))) {
+	/*
+	 * Listeners take their interface only. Datagram sockets in a VRF take
+	 * the VRF device: that way they receive what arrives on its ports at
+	 * all, and their replies are routed by its table.
+	 */
+	const char *dev = !sv->mcast_addr ? ep->ifname : vrf ? vrf->name : NULL;
+	if (dev && (ep->family == AF_INET || ep->family == AF_INET6)) {
+		if (setsockopt(ep->sock, SOL_SOCKET, SO_BINDTODEVICE, dev, strlen(dev))) {
 			ep->errstr = __FUNCTION__ ": SO_BINDTODEVICE";
 			ep->_errno = errno;
 			close(ep->sock);
@@ -441,7 +1415,28 @@ static int open_ep(struct endpoint **epp, struct service *sv, const struct ifadd
 		return -1;
 	}
 
-	if (sv->mcast_addr) {
+	if (sv->mcast_addr && !ifp) {
+		ep->shared = true;
+#ifdef IP_MULTICAST_ALL
+		/* Only the groups joined on this socket, demultiplexed by ifindex. */
+		if (ep->family == AF_INET &&
+			setsockopt(ep->sock, sp->ipproto_ip, IP_MULTICAST_ALL, &disable, sizeof(disable))) {
+			ep->errstr = __FUNCTION__ ": IP_MULTICAST_ALL";
+			ep->_errno = errno;
+			close(ep->sock);
+			return -1;
+		}
+#endif
+#ifdef IPV6_MULTICAST_ALL
+		if (ep->family == AF_INET6 &&
+			setsockopt(ep->sock, IPPROTO_IPV6, IPV6_MULTICAST_ALL, &disable, sizeof(disable))) {
+			ep->errstr = __FUNCTION__ ": IPV6_MULTICAST_ALL";
+			ep->_errno = errno;
+			close(ep->sock);
+			return -1;
+		}
+#endif
+	} else if (sv->mcast_addr) {
 #ifdef IP_MULTICAST_IF
 		/* Set multicast sending interface to avoid error: wsdd-mcast-v4: wsd_send_soap_msg: send: No route to host */
 		if (ep->family == AF_INET && ep->type == SOCK_DGRAM &&
@@ -462,238 +1457,1500 @@ static int open_ep(struct endpoint **epp, struct service *sv, const struct ifadd
 			return -1;
 		}
 #endif
+	}
+
+join:
+	if (sv->mcast_addr && ifp) {
 		/* Disable loopback. */
 		if (setsockopt(ep->sock, sp->ipproto_ip, sp->ip_multicast_loop, &disable, sizeof(disable))) {
 			ep->errstr = __FUNCTION__ ": IP_MULTICAST_LOOP";
 			ep->_errno = errno;
-			close(ep->sock);
+			if (!group)
+				close(ep->sock);
 			return -1;
 		}
 		/* Set inbound multicast. */
 		if (setsockopt(ep->sock, sp->ipproto_ip, sp->ip_add_membership, &ep->mreq, ep->mreqlen)) {
 			ep->errstr = __FUNCTION__ ": IP_ADD_MEMBERSHIP";
 			ep->_errno = errno;
-			close(ep->sock);
+			if (!group)
+				close(ep->sock);
 			return -1;
 		}
 	}
 
-	if (ep->type == SOCK_STREAM && listen(ep->sock, 5)) {
-		ep->errstr = __FUNCTION__ ": listen";
-		ep->_errno = errno;
-		close(ep->sock);
-		return -1;
+	if (group)
+		group_add(group, ep);
+
+	if (ep->type == SOCK_STREAM && listen(ep->sock, 5)) {
+		ep->errstr = __FUNCTION__ ": listen";
+		ep->_errno = errno;
+		close(ep->sock);
+		return -1;
+	}
+
+	return 0;
+#undef __FUNCTION__
+}
+
+/* Order endpoints by service, then namespace, VRF and identity. */
+static int ep_service_cmp(const void *a, const void *b)
+{
+	const struct endpoint *p = *(struct endpoint * const *) a;
+	const struct endpoint *q = *(struct endpoint * const *) b;
+
+	if (p->service != q->service)
+		return (p->service > q->service) - (p->service < q->service);
+	if (p->ns != q->ns)
+		return (p->ns > q->ns) - (p->ns < q->ns);
+	if (p->vrf != q->vrf)
+		return (p->vrf > q->vrf) - (p->vrf < q->vrf);
+	return (p->identity > q->identity) - (p->identity < q->identity);
+}
+
+static void ep_timer(void *arg)
+{
+	struct endpoint *ep = arg;
+
+	if (ep->service->timer(ep))
+		DEBUG(1, W, "%s timer failed: %s: %s", ep->service->name,
+			ep->errstr, strerror(ep->_errno));
+}
+
+/*
+ * Run the service init (hello) or exit (bye) handlers of eps[], batching
+ * the endpoints of a service, by namespace and VRF, if it has a handler
+ * for that.
+ */
+static void announce_eps(struct endpoint **eps, size_t n, bool hello)
+{
+	qsort(eps, n, sizeof(*eps), ep_service_cmp);
+
+	for (size_t i = 0, j; i < n; i = j) {
+		struct service *sv = eps[i]->service;
+
+		for (j = i; j < n && eps[j]->service == sv; j++)
+			;
+
+		if (hello && sv->init_batch) {
+			if (sv->init_batch(&eps[i], j - i))
+				DEBUG(1, W, "%s init failed: %s: %s", sv->name,
+					eps[i]->errstr, strerror(eps[i]->_errno));
+		} else if (!hello && sv->exit_batch) {
+			sv->exit_batch(&eps[i], j - i);
+		} else {
+			for (size_t k = i; k < j; k++) {
+				struct endpoint *ep = eps[k];
+				if (hello && sv->init && sv->init(ep))
+					DEBUG(1, W, "%s init failed: %s: %s", sv->name,
+						ep->errstr, strerror(ep->_errno));
+				else if (!hello && sv->exit)
+					sv->exit(ep);
+			}
+		}
+	}
+}
+
+static struct endpoint **ep_array(size_t n)
+{
+	struct endpoint **eps = calloc(n ? n : 1, sizeof(*eps));
+
+	if (!eps)
+		err(EXIT_FAILURE, "ep_array: calloc");
+	return eps;
+}
+
+/*
+ * Close an endpoint whose exit handler, if any, has already been run.
+ */
+static void close_ep(struct endpoint *ep)
+{
+	timer_cancel(&ep->timer);
+	sendq_drop(ep);
+	if (ep->activated)
+		return;
+	if (ep->shared) {
+		free(ep->member);
+		close(ep->sock);
+		return;
+	}
+	if (ep->service->mcast_addr)
+		setsockopt(ep->sock, sock_params[ep->family].ipproto_ip,
+			sock_params[ep->family].ip_drop_membership, &ep->mreq, ep->mreqlen);
+	if (ep->group)
+		group_del(ep->group, ep);
+	else
+		close(ep->sock);
+}
+
+static jmp_buf sigenv;
+volatile sig_atomic_t restart;
+
+void restart_service(void)
+{
+	DEBUG(1, W, "restarting service.");
+	restart = 1;
+	longjmp(sigenv, 1);
+}
+
+static int netlink_input(struct endpoint *ep, struct datagram *dg)
+{
+#define __FUNCTION__	"netlink_input"
+	size_t msglen = dg->len;
+
+#ifdef NL_DEBUG
+	nl_debug(dg->buf, msglen);
+#endif
+	for (struct nlmsghdr *nh = (struct nlmsghdr *) dg->buf;
+			NLMSG_OK(nh, msglen) && nh->nlmsg_type != NLMSG_DONE;
+			nh = NLMSG_NEXT(nh, msglen)) {
+		if (netif_update(ep->ns->db, nh)) {
+			DEBUG(2, W, __FUNCTION__ ": %s detected%s.",
+				(nh->nlmsg_type == RTM_NEWLINK || nh->nlmsg_type == RTM_DELLINK) ?
+				"link change" : "address addition/change/deletion", ep->ns->label);
+			coalesce_event(ep->ns, false);
+		}
+	}
+
+	return 0;
+#undef __FUNCTION__
+}
+
+/*
+ * Read every pending netlink message. Lost messages, whether the socket
+ * overflowed or one did not fit the buffer (which then grows to fit),
+ * make for a resync; whatever is still queued then is stale and dropped.
+ */
+static int netlink_recv(struct endpoint *ep)
+{
+#define __FUNCTION__	"netlink_recv"
+	static char *buf;	/* control thread only */
+	static size_t bufsize = PAGE_SIZE;
+	bool lost = false;
+
+	if (!buf && !(buf = (char *) malloc(bufsize))) {
+		ep->_errno = ENOMEM;
+		ep->errstr = __FUNCTION__ ": malloc";
+		return -1;
+	}
+
+	for (;;) {
+		struct datagram dg = { .buf = buf };
+		struct iovec iov = { buf, bufsize };
+		struct msghdr msg = { &dg.from.nl, sizeof dg.from.nl, &iov, 1, NULL, 0, 0 };
+		ssize_t msglen = recvmsg(ep->sock, &msg, MSG_DONTWAIT | MSG_TRUNC);
+
+		if (msglen < 0 && errno == EINTR)
+			continue;
+		if (msglen < 0 && errno == EAGAIN)
+			break;
+		DEBUG(2, W, "%s: %zd bytes", __func__, msglen);
+		if (msglen < 0 && errno == ENOBUFS) {
+			LOG(LOG_WARNING, "%s: receive buffer overflow%s (%lu so far), resyncing",
+				__FUNCTION__, ep->ns->label, ++nl_overflows);
+			lost = true;
+			continue;
+		}
+		if (msglen <= 0) {
+			ep->_errno = errno;
+			ep->errstr = __FUNCTION__ ": netlink_recv: recv";
+			return -1;
+		}
+		if (msg.msg_flags & MSG_TRUNC) {
+			char *nbuf = (char *) realloc(buf, msglen);
+
+			LOG(LOG_WARNING, "%s: %zd byte message truncated, resyncing",
+				__FUNCTION__, msglen);
+			if (nbuf) {
+				buf = nbuf;
+				bufsize = msglen;
+			}
+			lost = true;
+			continue;
+		}
+		ep->ns->nl_received++;
+		if (lost)
+			continue;
+
+		dg.len = msglen;
+		netlink_input(ep, &dg);
+	}
+
+	if (lost)
+		coalesce_event(ep->ns, true);
+	return 0;
+#undef __FUNCTION__
+}
+
+static void sighandler(int sig)
+{
+	DEBUG(0, W, "'%s' signal received.", strsignal(sig));
+	switch (sig) {
+	case SIGHUP:
+		restart = 1;
+		break;
+	default:
+		restart = 2;
+	}
+}
+
+struct smbparm {
+	const char *name;
+	const char **value;
+	const char *_default;
+};
+
+/*
+ * Fill in the smb.conf parameters from one testparm run. Each run parses
+ * all of smb.conf, includes and all, so they are asked for at once: the
+ * [global] section with defaults, which comes first in the dump. A value
+ * that is missing or empty takes the default.
+ */
+static int get_smbparms(struct smbparm *parms, size_t nparms)
+{
+#define __FUNCTION__	"get_smbparms"
+	FILE *pp = popen("testparm -s -v 2>/dev/null", "r");
+
+	if (!pp)
+		DEBUG(0, W, __FUNCTION__ ": can't run testparam");
+
+	char buf[PAGE_SIZE];
+	bool global = false;
+
+	while (pp && fgets(buf, sizeof(buf), pp)) {
+		char *p, *val;
+
+		// trim whitespace
+		for (p = buf + strlen(buf) - 1; buf <= p && isspace(*p); p--)
+			*p = '\0';
+		for (p = buf; *p && isspace(*p); p++)
+			;
+
+		if (*p == '[') {
+			if (global)
+				break;
+			global = !strcasecmp(p, "[global]");
+			continue;
+		}
+		if (!global || !(val = strstr(p, " =")))
+			continue;
+		for (*val = '\0', val += 2; *val && isspace(*val); val++)
+			;
+
+		for (size_t i = 0; i < nparms; i++) {
+			if (*parms[i].value || !*val || strcasecmp(p, parms[i].name))
+				continue;
+			if (!(*parms[i].value = strdup(val)))
+				goto fail;
+		}
+	}
+
+	for (size_t i = 0; i < nparms; i++) {
+		if (*parms[i].value)
+			continue;
+		DEBUG(0, W, "cannot read %s from testparm", parms[i].name);
+		if (!(*parms[i].value = strdup(parms[i]._default)))
+			goto fail;
+	}
+
+	if (pp)
+		pclose(pp);
+	return 0;
+
+fail:
+	if (pp)
+		pclose(pp);
+	return -1;
+#undef __FUNCTION__
+}
+
+static void help(const char *prog, int ec, const char *fmt, ...)
+{
+	if (fmt) {
+		va_list ap;
+		va_start(ap, fmt);
+		vprintf(fmt, ap);
+		va_end(ap);
+		puts("\n");
+	}
+	printf( "WSDD and LLMNR daemon\n"
+		"Usage: %s [options]\n"
+		"       -h this message\n"
+		"       -d become daemon\n"
+		"       -4 IPv4 only\n"
+		"       -6 IPv6 only\n"
+		"       -u UDP only\n"
+		"       -t TCP only\n"
+		"       -l LLMNR only\n"
+		"       -w WSDD only\n"
+		"       -L increment LLMNR debug level (%d)\n"
+		"       -W increment WSDD debug level (%d)\n"
+		"       -i <if,...> reply only on these interfaces, globs allowed (%s)\n"
+		"       -x <if,...> never reply on these interfaces, globs allowed\n"
+		"          (also " DEFAULT_EXCLUDES " unless -i is given)\n"
+		"       -n <netns,...> serve these network namespaces (. for our own)\n"
+		"       -D <msec> coalesce interface changes for this quiet period (%u)\n"
+		"       -R <KiB> netlink receive buffer size (%u)\n"
+		"       -s share one multicast socket per service among interfaces\n"
+		"       -j <n> run n event loops, sharding TCP and unicast UDP (%u)\n"
+		"       -c with -j, steer connections by CPU and pin workers to CPUs\n"
+		"       -H <name> set host name (%s)\n"
+		"       -A \"name list\" set host aliases (%s)\n"
+		"       -N <name> set netbios name (%s)\n"
+		"       -B \"name list\" set netbios aliases (%s)\n"
+		"       -G <name> set workgroup (%s)\n"
+		"       -P \"<if|addr,...>=key:val,...\" answer as another identity there, keys:\n"
+		"          hostname hostaliases netbiosname netbiosaliases workgroup\n"
+		"       -b \"key1:val1,key2:val2,...\" boot parameters:\n",
+		prog, debug_L, debug_W, ifname ? ifname : "any", coalesce_ms, nl_rcvbuf_kb, nloops,
+		hostname, hostaliases, netbiosname, netbiosaliases, workgroup
+	);
+	printBootInfoKeys(stdout, 11);
+	exit(ec);
+}
+
+static long long smbconf_ms;	/* time init_sysinfo() took on testparm */
+
+static void init_sysinfo()
+{
+	char hostn[HOST_NAME_MAX + 1];
+
+	if (!hostname && gethostname(hostn, sizeof(hostn) - 1) != 0)
+		err(EXIT_FAILURE, "gethostname");
+
+	char *p = strchr(hostn, '.');
+	if (p) *p = '\0';
+	hostname = strdup(hostn);
+
+	struct smbparm parms[] = {
+		{ "additional dns hostnames", &hostaliases, "" },
+		{ "netbios name", &netbiosname, hostname },
+		{ "netbios aliases", &netbiosaliases, "" },
+		{ "workgroup", &workgroup, "WORKGROUP" },
+	};
+	long long t = mono_ms();
+
+	if (get_smbparms(parms, ARRAY_SIZE(parms)))
+		err(EXIT_FAILURE, "get_smbparms");
+	smbconf_ms = mono_ms() - t;
+
+	init_getresp();
+}
+
+/*
+ * Add a -P profile "<if|address,...>=<key>:<value>,...". The strings it
+ * keeps point into a copy of arg that lives as long as we do.
+ */
+static int add_profile(const char *arg)
+{
+	char *list = strdup(arg), *keys = list ? strchr(list, '=') : NULL, *save = NULL;
+
+	if (!keys)
+		goto bad;
+	*keys++ = '\0';
+
+	struct identity *p = realloc(profiles, (nprofiles + 1) * sizeof(*p));
+	if (!p)
+		err(EXIT_FAILURE, "realloc");
+	profiles = p;
+	p = memset(&profiles[nprofiles], 0, sizeof(*p));
+
+	for (char *tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		struct netaddr na = { .family = AF_INET };
+
+		if (inet_pton(AF_INET, tok, &na.addr) != 1 &&
+			inet_pton(na.family = AF_INET6, tok, &na.addr) != 1) {
+			if (netif_match_add(&p->ifs, tok))
+				err(EXIT_FAILURE, "netif_match_add");
+			continue;
+		}
+
+		struct netaddr *addrs = realloc(p->addrs, (p->naddrs + 1) * sizeof(*addrs));
+		if (!addrs)
+			err(EXIT_FAILURE, "realloc");
+		p->addrs = addrs;
+		p->addrs[p->naddrs++] = na;
+	}
+
+	for (char *tok = strtok_r(keys, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		const struct { const char *key; const char **value; } fields[] = {
+			{ "hostname", &p->hostname },
+			{ "hostaliases", &p->hostaliases },
+			{ "netbiosname", &p->netbiosname },
+			{ "netbiosaliases", &p->netbiosaliases },
+			{ "workgroup", &p->workgroup },
+		};
+		char *val = strchr(tok, ':');
+		size_t i;
+
+		if (!val)
+			goto bad;
+		*val++ = '\0';
+		for (i = 0; i < ARRAY_SIZE(fields) && strcmp(tok, fields[i].key); i++)
+			;
+		if (i == ARRAY_SIZE(fields) || !*val)
+			goto bad;
+		*fields[i].value = val;
+	}
+
+	if ((!p->ifs.npat && !p->naddrs) || (!p->hostname && !p->netbiosname)) {
+		netif_match_free(&p->ifs);
+		free(p->addrs);
+		goto bad;
+	}
+	nprofiles++;
+	return 0;
+
+bad:
+	free(list);
+	return -1;
+}
+
+/*
+ * Complete the identities once all options are in: a profile's names
+ * default to each other, its aliases to none and its workgroup to ours.
+ */
+static void init_identities(void)
+{
+	identity.hostname = hostname;
+	identity.hostaliases = hostaliases;
+	identity.netbiosname = netbiosname;
+	identity.netbiosaliases = netbiosaliases;
+	identity.workgroup = workgroup;
+	wsd_set_endpoint(&identity, NULL);
+
+	for (size_t i = 0; i < nprofiles; i++) {
+		struct identity *p = &profiles[i];
+
+		if (!p->hostname)
+			p->hostname = p->netbiosname;
+		if (!p->netbiosname)
+			p->netbiosname = p->hostname;
+		if (!p->hostaliases)
+			p->hostaliases = "";
+		if (!p->netbiosaliases)
+			p->netbiosaliases = "";
+		if (!p->workgroup)
+			p->workgroup = workgroup;
+		wsd_set_endpoint(p, &identity);
+		DEBUG(1, W, "profile %zu: hostname %s, netbios name %s, workgroup %s, endpoint %s",
+			i + 1, p->hostname, p->netbiosname, p->workgroup, p->endpoint);
+	}
+}
+
+#define	_4	1
+#define	_6	2
+#define _TCP	1
+#define _UDP	2
+#define	_LLMNR	1
+#define	_WSDD	2
+
+static unsigned int ipv46, tcpudp, llmnrwsdd;
+
+static bool service_enabled(const struct service *sv)
+{
+	if (!(ipv46 & _4) && sv->family == AF_INET)
+		return false;
+	if (!(ipv46 & _6) && sv->family == AF_INET6)
+		return false;
+	if (!(tcpudp & _TCP) && sv->type == SOCK_STREAM)
+		return false;
+	if (!(tcpudp & _UDP) && sv->type == SOCK_DGRAM)
+		return false;
+	if (!(llmnrwsdd & _LLMNR) && strstr(sv->name, "llmnr"))
+		return false;
+	if (!(llmnrwsdd & _WSDD) && strstr(sv->name, "wsdd"))
+		return false;
+	return true;
+}
+
+/*
+ * With -s, the one socket of multicast service sv that all interfaces'
+ * endpoints in namespace ns share, opened on first use. NULL means
+ * per-interface sockets.
+ */
+static struct endpoint *shared_ep(struct netns *ns, struct service *sv)
+{
+	struct endpoint *ep;
+
+	if (!shared_mcast || !sv->mcast_addr || sv->type != SOCK_DGRAM)
+		return NULL;
+
+	for (ep = endpoints; ep; ep = ep->next)
+		if (ep->shared && ep->service == sv && ep->ns == ns)
+			return ep;
+
+	if (open_ep(&ep, ns, sv, NULL, NULL, NULL) != 0) {
+		LOG(LOG_ERR, "error: %s: %s: %s", ep->service->name,
+			ep->errstr, strerror(ep->_errno));
+		free(ep);
+		return NULL;
+	} else if (ep->sock < 0) {
+		free(ep);
+		return NULL;
+	} else if (add_ep(ep)) {
+		LOG(LOG_ERR, "error: %s: %s: %s", ep->service->name,
+			ep->errstr, strerror(ep->_errno));
+		close(ep->sock);
+		free(ep);
+		return NULL;
+	}
+
+	DEBUG(1, W, "%s: shared socket opened%s", sv->name, ns->label);
+	return ep;
+}
+
+/*
+ * systemd socket activation: TCP listeners passed in as fds from
+ * SD_LISTEN_FDS_START on ($LISTEN_PID, $LISTEN_FDS) stand in for the
+ * per-interface listeners of the service they match by family and port.
+ * They are adopted once, survive restarts and are never closed. Both this
+ * and notify_systemd() are simple enough not to need libsystemd.
+ */
+#define SD_LISTEN_FDS_START	3
+#define LISTEN_FDS_MAX		8
+
+static struct {
+	int fd;
+	struct service *sv;
+} listen_fds[LISTEN_FDS_MAX];
+static size_t nlisten_fds;
+
+static void listen_fds_init(void)
+{
+	const char *pid = getenv("LISTEN_PID"), *fds = getenv("LISTEN_FDS");
+	int n = (pid && fds && strtol(pid, NULL, 10) == getpid()) ? atoi(fds) : 0;
+
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	for (int fd = SD_LISTEN_FDS_START; fd < SD_LISTEN_FDS_START + n; fd++) {
+		int type = 0, listening = 0;
+		socklen_t tlen = sizeof type, llen = sizeof listening;
+		_saddr_t sa;
+		socklen_t slen = sizeof sa;
+		struct service *sv = NULL;
+
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		if (!getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &tlen) &&
+			!getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &llen) &&
+			!getsockname(fd, &sa.sa, &slen) && type == SOCK_STREAM && listening &&
+			(sa.ss.ss_family == AF_INET || sa.ss.ss_family == AF_INET6)) {
+			for (size_t svn = 0; svn < ARRAY_SIZE(services); svn++) {
+				if (services[svn].type == SOCK_STREAM &&
+					services[svn].family == sa.ss.ss_family &&
+					service_port(&services[svn]) == _SIN_PORT(&sa))
+					sv = &services[svn];
+			}
+		}
+
+		if (!sv || nlisten_fds == LISTEN_FDS_MAX) {
+			LOG(LOG_WARNING, "socket activation: fd %d is no listener of ours, ignored", fd);
+			continue;
+		}
+		if (ifname && setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, ifname, strlen(ifname)))
+			LOG(LOG_WARNING, "%s: socket activation: SO_BINDTODEVICE: %s",
+				sv->name, strerror(errno));
+		listen_fds[nlisten_fds].fd = fd;
+		listen_fds[nlisten_fds++].sv = sv;
+		DEBUG(1, W, "%s: listening on fd %d from systemd", sv->name, fd);
+	}
+}
+
+static bool service_activated(const struct service *sv)
+{
+	for (size_t i = 0; i < nlisten_fds; i++)
+		if (listen_fds[i].sv == sv)
+			return true;
+	return false;
+}
+
+/*
+ * Put the listeners from systemd on the endpoint list, after (re)start.
+ * They live in our own namespace; unless that is served, they go unused.
+ */
+static void adopt_listeners(void)
+{
+	struct netns *ns = own_netns();
+
+	for (size_t i = 0; ns && i < nlisten_fds; i++) {
+		struct service *sv = listen_fds[i].sv;
+
+		if (!service_enabled(sv))
+			continue;
+
+		struct endpoint *ep = (struct endpoint *) calloc(sizeof(*ep), 1);
+		if (!ep)
+			err(EXIT_FAILURE, "adopt_listeners: calloc");
+
+		strncpy(ep->ifname, "systemd", sizeof(ep->ifname));
+		ep->ns = ns;
+		ep->identity = &identity;
+		ep->service = sv;
+		ep->family = sv->family;
+		ep->type = sv->type;
+		ep->protocol = sv->protocol;
+		ep->port = service_port(sv);
+		ep->sock = listen_fds[i].fd;
+		ep->activated = true;
+		socklen_t slen = sizeof(ep->local);
+		if (!getsockname(ep->sock, &ep->local.sa, &slen))
+			ep->llen = slen;
+
+		if (add_ep(ep)) {
+			LOG(LOG_ERR, "error: %s: %s: %s", sv->name, ep->errstr, strerror(ep->_errno));
+			free(ep);
+		}
+	}
+}
+
+/*
+ * Report state to systemd if it is listening ($NOTIFY_SOCKET): a single
+ * datagram on a unix socket, '@' standing for the abstract namespace.
+ */
+static void notify_systemd(const char *state)
+{
+	const char *path = getenv("NOTIFY_SOCKET");
+	struct sockaddr_un un = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (!path || (*path != '/' && *path != '@') || strlen(path) >= sizeof(un.sun_path))
+		return;
+
+	memcpy(un.sun_path, path, strlen(path));
+	if (*path == '@')
+		un.sun_path[0] = '\0';
+
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0 ||
+		sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *) &un,
+			offsetof(struct sockaddr_un, sun_path) + strlen(path)) < 0)
+		LOG(LOG_WARNING, "notify_systemd: %s: %s", state, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+}
+
+#ifndef USE_IO_URING
+/*
+ * Hand one ready endpoint to its connection or service. A service error
+ * restarts everything from the main loop; a worker just stops polling
+ * the failing socket, whose twin in the main loop is still served.
+ */
+static void dispatch_ep(struct endpoint *ep)
+{
+	if (ep->dead)	/* deleted earlier in this batch */
+		return;
+	if (ep->conn) {
+		conn_recv(ep->conn);
+		return;
+	}
+	DEBUG(3, W, "dispatch %s recv", ep->service->name);
+	if (!ep->service->recv || ep->service->recv(ep) >= 0)
+		return;
+	if (loop_worker) {
+		LOG(LOG_WARNING, "%s: %s: %s, dropped from worker", ep->service->name,
+			ep->errstr, strerror(ep->_errno));
+		del_ep(ep);
+		return;
+	}
+	DEBUG(1, W, "Detected %s socket error, restarting", ep->service->name);
+	restart_service();
+}
+
+/*
+ * Worker event loops (-j N). N-1 threads run next to the main loop, each
+ * with a SO_REUSEPORT twin of every TCP listener and a unicast-only
+ * socket per UDP service, so the kernel spreads connections and unicast
+ * queries over all loops. Multicast stays with the main loop, as a group
+ * datagram is delivered to every socket of a reuseport group and would
+ * only be answered N times. The main loop owns the endpoints and
+ * drives the workers through a pipe; a worker owns the endpoints it has
+ * been handed and frees them on WORKER_DEL or exit.
+ */
+struct worker {
+	unsigned int id;		/* 1..nloops-1, its reuseport index */
+	pthread_t thread;
+	int epfd;
+	int cmd[2];			/* command pipe, read end polled */
+	struct endpoint ctl;
+	struct endpoint *eps;		/* handed to the worker thread */
+	struct endpoint *dead;		/* deleted, freed after the event batch */
+	bool done;
+};
+
+struct worker_cmd {
+	enum { WORKER_ADD, WORKER_DEL, WORKER_EXIT } op;
+	struct endpoint *ep;
+};
+
+static struct worker *workers;
+
+static int worker_recv(struct endpoint *ep);
+
+static struct service worker_service = {
+	.name	= "worker",
+	.recv	= worker_recv,
+};
+
+static void worker_send(struct worker *w, int op, struct endpoint *ep)
+{
+	const struct worker_cmd cmd = { .op = op, .ep = ep };
+
+	/* Commands are far below PIPE_BUF, so each write is atomic. */
+	while (write(w->cmd[1], &cmd, sizeof cmd) < 0 && errno == EINTR)
+		;
+}
+
+/* Close and free the endpoints deleted during the last event batch. */
+static void worker_bury(struct worker *w)
+{
+	while (w->dead) {
+		struct endpoint *ep = w->dead;
+		w->dead = ep->next;
+		close(ep->sock);
+		free(ep);
+	}
+}
+
+static int worker_recv(struct endpoint *ep)
+{
+	struct worker *w = loop_worker;
+	struct worker_cmd cmd;
+
+	while (read(ep->sock, &cmd, sizeof cmd) == sizeof cmd) {
+		switch (cmd.op) {
+		case WORKER_ADD:
+			/* Kept even if polling fails, the main loop will delete it. */
+			if (poll_ep(cmd.ep))
+				LOG(LOG_WARNING, "worker %u: %s: %s: %s", w->id,
+					cmd.ep->service->name, cmd.ep->errstr,
+					strerror(cmd.ep->_errno));
+			cmd.ep->next = w->eps;
+			w->eps = cmd.ep;
+			break;
+		case WORKER_DEL:
+			for (struct endpoint **epp = &w->eps; *epp; epp = &(*epp)->next) {
+				if (*epp == cmd.ep) {
+					*epp = cmd.ep->next;
+					break;
+				}
+			}
+			/* Events for it may follow in this batch: bury it for now. */
+			del_ep(cmd.ep);
+			sendq_drop(cmd.ep);
+			cmd.ep->dead = true;
+			cmd.ep->next = w->dead;
+			w->dead = cmd.ep;
+			break;
+		case WORKER_EXIT:
+			w->done = true;
+			break;
+		}
+	}
+	return 0;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	loop_worker = w;
+	epoll_fd = w->epfd;
+	if (poll_ep(&w->ctl))
+		err(EXIT_FAILURE, "worker %u: %s", w->id, w->ctl.errstr);
+	DEBUG(1, W, "worker %u: started", w->id);
+
+	while (!w->done) {
+		struct epoll_event events[EPOLL_MAX_EVENTS];
+		int n;
+
+		netif_offline();
+		n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), timer_timeout());
+		netif_online();
+		if (n < 0 && errno != EINTR) {
+			LOG(LOG_WARNING, "worker %u: event wait: %s", w->id, strerror(errno));
+			break;
+		}
+		for (int i = 0; i < n; i++)
+			dispatch_ep((struct endpoint *) events[i].data.ptr);
+		worker_bury(w);
+		timer_run();
+	}
+
+	netif_detach();
+	batch_stats(1);
+	close_conns();
+	sendq_drop(NULL);
+	timer_free();
+	worker_bury(w);
+	while (w->eps) {
+		struct endpoint *ep = w->eps;
+		w->eps = ep->next;
+		close(ep->sock);
+		free(ep);
+	}
+	DEBUG(1, W, "worker %u: stopped", w->id);
+	return NULL;
+}
+
+/*
+ * Open sv's socket for a worker. It is bound like the multicast
+ * endpoints, which puts it in their reuseport group, but joins no group
+ * and has *_MULTICAST_ALL off, so only unicast reaches it.
+ */
+static struct endpoint *open_unicast_ep(struct netns *ns, struct service *sv)
+{
+	struct endpoint *ep;
+
+	if (open_ep(&ep, ns, sv, NULL, NULL, NULL) != 0) {
+		LOG(LOG_WARNING, "%s: worker socket%s: %s: %s", sv->name, ns->label,
+			ep->errstr, strerror(ep->_errno));
+		free(ep);
+		return NULL;
+	} else if (ep->sock < 0) {
+		free(ep);
+		return NULL;
+	}
+	ep->shared = false;
+	return ep;
+}
+
+/*
+ * With -c, pick a listener's reuseport group member by the CPU that took
+ * the connection: CPU c goes to loop c % nloops, whose worker is pinned
+ * to exactly those CPUs.
+ */
+static void steer_listener(struct endpoint *ep)
+{
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nloops),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	const struct sock_fprog prog = { .len = ARRAY_SIZE(code), .filter = code };
+
+	if (setsockopt(ep->sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)))
+		LOG(LOG_WARNING, "%s @ %s: SO_ATTACH_REUSEPORT_CBPF: %s",
+			ep->service->name, ep->ifname, strerror(errno));
+}
+
+static void pin_worker(struct worker *w)
+{
+	cpu_set_t cpus;
+	long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+
+	CPU_ZERO(&cpus);
+	for (long c = w->id; c < ncpu && c < CPU_SETSIZE; c += nloops)
+		CPU_SET(c, &cpus);
+	if (CPU_COUNT(&cpus) && pthread_setaffinity_np(w->thread, sizeof(cpus), &cpus))
+		LOG(LOG_WARNING, "worker %u: pthread_setaffinity_np: %s", w->id, strerror(errno));
+}
+
+/*
+ * Open worker twins of listener ep, freshly opened for ifp/na. Each
+ * joins ep's reuseport group right after it, in worker order.
+ */
+static void clone_listener(struct endpoint *ep, const struct netif *ifp,
+			const struct netaddr *na)
+{
+	for (unsigned int i = 0; workers && i < nloops - 1; i++) {
+		struct endpoint *c;
+
+		if (open_ep(&c, ep->ns, ep->service, ifp, na, NULL) != 0 || c->sock < 0) {
+			LOG(LOG_WARNING, "%s @ %s: worker %u: %s: %s", ep->service->name,
+				ep->ifname, workers[i].id, c->errstr, strerror(c->_errno));
+			free(c);
+			continue;
+		}
+		c->worker = &workers[i];
+		c->clone = ep->clone;
+		ep->clone = c;
+		worker_send(c->worker, WORKER_ADD, c);
+	}
+	if (steer_cpu && ep->clone)
+		steer_listener(ep);
+}
+
+static void drop_clones(struct endpoint *ep)
+{
+	struct endpoint *c, *next;
+
+	/* The worker frees c, so step past it first. */
+	for (c = ep->clone; c; c = next) {
+		next = c->clone;
+		worker_send(c->worker, WORKER_DEL, c);
+	}
+	ep->clone = NULL;
+}
+
+static void start_workers(void)
+{
+	sigset_t all, old;
+
+	if (nloops < 2)
+		return;
+
+	workers = (struct worker *) calloc(nloops - 1, sizeof(*workers));
+	if (!workers)
+		err(EXIT_FAILURE, "start_workers: calloc");
+
+	/* Signals are for the main loop. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	for (unsigned int i = 0; i < nloops - 1; i++) {
+		struct worker *w = &workers[i];
+
+		w->id = i + 1;
+		if (pipe2(w->cmd, O_CLOEXEC) || fcntl(w->cmd[0], F_SETFL, O_NONBLOCK))
+			err(EXIT_FAILURE, "start_workers: pipe");
+		if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+			err(EXIT_FAILURE, "start_workers: epoll_create1");
+		w->ctl.service = &worker_service;
+		w->ctl.sock = w->cmd[0];
+
+		for (size_t k = 0; k < nnetns; k++) {
+			for (size_t svn = 0; svn < ARRAY_SIZE(services); svn++) {
+				struct service *sv = &services[svn];
+				struct endpoint *ep;
+
+				if (sv->type == SOCK_DGRAM && sv->mcast_addr && service_enabled(sv) &&
+					(ep = open_unicast_ep(&netns[k], sv))) {
+					ep->worker = w;
+					worker_send(w, WORKER_ADD, ep);
+				}
+			}
+		}
+
+		errno = pthread_create(&w->thread, NULL, worker_main, w);
+		if (errno)
+			err(EXIT_FAILURE, "start_workers: pthread_create");
+		if (steer_cpu)
+			pin_worker(w);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	DEBUG(1, W, "%u worker loops started", nloops - 1);
+}
+
+static void stop_workers(void)
+{
+	if (!workers)
+		return;
+
+	for (unsigned int i = 0; i < nloops - 1; i++)
+		worker_send(&workers[i], WORKER_EXIT, NULL);
+	for (unsigned int i = 0; i < nloops - 1; i++) {
+		struct worker *w = &workers[i];
+
+		pthread_join(w->thread, NULL);
+		close(w->cmd[0]);
+		close(w->cmd[1]);
+		close(w->epfd);
 	}
+	free(workers);
+	workers = NULL;
 
-	return 0;
-#undef __FUNCTION__
+	/* The workers have freed every clone on their way out. */
+	for (struct endpoint *ep = endpoints; ep; ep = ep->next)
+		ep->clone = NULL;
+}
+#else
+static void clone_listener(struct endpoint *ep, const struct netif *ifp,
+			const struct netaddr *na)
+{
+	(void) ep; (void) ifp; (void) na; // silent "unused" warning
 }
 
-static void close_ep(struct endpoint *ep)
+static void drop_clones(struct endpoint *ep)
 {
-	if (ep->service->exit)
-		ep->service->exit(ep);
-	if (ep->service->mcast_addr)
-		setsockopt(ep->sock, sock_params[ep->family].ipproto_ip,
-			sock_params[ep->family].ip_drop_membership, &ep->mreq, ep->mreqlen);
-	close(ep->sock);
+	(void) ep; // silent "unused" warning
 }
 
-static jmp_buf sigenv;
-volatile sig_atomic_t restart;
+static void start_workers(void) {}
+static void stop_workers(void) {}
+#endif
 
-void restart_service(void)
+/*
+ * Whether the addresses of ifp are served at all. The control thread
+ * asks this when it builds a snapshot, which then holds the addresses of
+ * usable links only; the answer is kept until the link changes.
+ */
+static bool link_usable(const struct netif *ifp, const struct netif *master)
 {
-	DEBUG(1, W, "restarting service.");
-	restart = 1;
-	longjmp(sigenv, 1);
+	const struct netif *vrf = master && strcmp(master->kind, "vrf") == 0 ? master : NULL;
+
+	if (ifp->flags & IFF_SLAVE)
+		return false;
+	if (strcmp(ifp->kind, "vrf") == 0) {
+		DEBUG(2, W, "skipped %s: VRF device", ifp->name);
+		return false;
+	}
+	if (include_ifs.npat) {
+		if (!link_match(&include_ifs, ifp, vrf) ||
+			link_match(&exclude_ifs, ifp, vrf)) {
+			DEBUG(2, W, "skipped %s: not selected", ifp->name);
+			return false;
+		}
+		return true;
+	}
+
+	if (!(ifp->flags & IFF_MULTICAST)) {
+		DEBUG(2, W, "skipped %s: not multicast", ifp->name);
+		return false;
+	}
+	if (ifp->flags & IFF_LOOPBACK) {
+		DEBUG(2, W, "skipped %s: loopback", ifp->name);
+		return false;
+	}
+	if (link_match(&exclude_ifs, ifp, vrf) ||
+		netif_match(&default_excludes, ifp->name)) {
+		DEBUG(2, W, "skipped %s: excluded by name", ifp->name);
+		return false;
+	}
+	// skip bridge, bond or team ports unless selected on the command line
+	if (ifp->master && !vrf) {
+		DEBUG(2, W, "skipped %s: %s port", ifp->name,
+			master && master->kind[0] ? master->kind : "enslaved");
+		return false;
+	}
+	return true;
 }
 
-static bool is_new_addr(struct nlmsghdr *nh)
+/*
+ * Open the endpoints of namespace ns that its current interface snapshot
+ * calls for, and unmark the stale ones it still has. Returns the number
+ * opened, which are marked fresh.
+ */
+static unsigned int reconcile_netns(struct netns *ns)
 {
-	struct ifaddrmsg *ifam = (struct ifaddrmsg *) NLMSG_DATA(nh);
-	struct rtattr *rta = IFA_RTA(ifam);
-	size_t rtasize = IFA_PAYLOAD(nh);
+	const struct netif_table *t = netif_get(ns->db);
+	struct endpoint *ep;
+	unsigned int opened = 0;
+
+	// Follow a renumbered -i interface, unless that names a VRF
+	if (ifname) {
+		const struct netif *ifp = netif_find_name(t, ifname);
+		if (ifp && strcmp(ifp->kind, "vrf") != 0)
+			ns->ifindex = ifp->index;
+	}
 
-	if (nh->nlmsg_type != RTM_NEWADDR)
-		return false;
+	for (size_t svn = 0; svn < ARRAY_SIZE(services); svn++) {
+		struct service *sv = &services[svn];
 
-	if (ifindex && ifam->ifa_index != ifindex) {
-		char buf[IFNAMSIZ];
-		if (!if_indextoname(ifam->ifa_index, buf) || strcmp(buf, ifname) != 0)
-			return false;
-		ifindex = ifam->ifa_index;
+		if (!(sv->family == AF_INET || sv->family == AF_INET6) || !service_enabled(sv) ||
+			(service_activated(sv) && ns->fd < 0))
+			continue;
+
+		for (size_t i = 0; i < t->naddrs; i++) {
+			const struct netaddr *na = &t->addrs[i];
+			const struct netif *ifp = netif_find(t, na->index);
+
+			if (!ifp || na->family != sv->family)
+				continue;
+
+			const struct netif *vrf = vrf_master(t, ifp);
+			char ifaddr[_ADDRSTRLEN];
+			inet_ntop(na->family, &na->addr, ifaddr, sizeof(ifaddr));
+
+			// skip if already bound to this interface (and VRF)
+			ep = NULL;
+			for (struct endpoint *e = endpoints; e; e = e->next)
+				if (e->service == sv && e->ns == ns && e->ifindex == ifp->index &&
+					e->vrf == (vrf ? vrf->index : 0) &&
+					strcmp(e->ifname, ifp->name) == 0)
+					ep = e;
+
+			// show interface
+			DEBUG(ep && !ep->fresh ? 3 : 1, W, "%s %s port %d %s %s @ %s%s%s%s%s", sv->name,
+				socktype_str[sv->type], sv->port_num,
+				sv->mcast_addr ? sv->mcast_addr : "-",
+				ifaddr, ifp->name, vrf ? " vrf " : "", vrf ? vrf->name : "",
+				ns->label, ep ? ": already bound" : "");
+			if (ep) {
+				ep->stale = false;
+				continue;
+			}
+
+			// open socket for this interface/family; a VRF needs its own
+			if (open_ep(&ep, ns, sv, ifp, na, vrf ? NULL : shared_ep(ns, sv)) != 0) {
+				LOG(LOG_ERR, "error: %s: %s: %s", ep->service->name,
+					ep->errstr, strerror(ep->_errno));
+				free(ep);
+				continue;
+			} else if (ep->sock < 0) {
+				free(ep);
+			} else if (add_ep(ep)) {
+				LOG(LOG_ERR, "error: %s: %s: %s", ep->service->name,
+					ep->errstr, strerror(ep->_errno));
+				close(ep->sock);
+				free(ep);
+			} else {
+				ep->fresh = true;
+				opened++;
+				if (ep->type == SOCK_STREAM)
+					clone_listener(ep, ifp, na);
+			}
+		}
+	}
+	return opened;
+}
+
+/*
+ * Bring the IP endpoints in line with the current interface snapshots.
+ * Endpoints whose (namespace, service, interface) triple is still usable
+ * are left alone; new ones are opened and announced, and vanished ones
+ * are closed (sending Bye) before any new endpoint sends its Hello.
+ */
+static void reconcile_eps(void)
+{
+	struct endpoint *ep;
+	unsigned int opened = 0, closed = 0;
+
+	for (ep = endpoints; ep; ep = ep->next) {
+		ep->stale = !ep->shared && !ep->activated &&
+			(ep->family == AF_INET || ep->family == AF_INET6);
+		ep->fresh = false;
+	}
+
+	for (size_t k = 0; k < nnetns; k++)
+		opened += reconcile_netns(&netns[k]);
+
+	// Say Bye for all vanished endpoints at once, then close them
+	size_t n = opened; /* all fresh */
+	for (ep = endpoints; ep; ep = ep->next)
+		n += ep->stale;
+
+	struct endpoint **eps = ep_array(n);
+	n = 0;
+	for (struct endpoint **epp = &endpoints; (ep = *epp);) {
+		if (!ep->stale) {
+			epp = &ep->next;
+			continue;
+		}
+		DEBUG(1, W, "%s @ %s%s: interface gone, closing", ep->service->name,
+			ep->ifname, ep->ns->label);
+		*epp = ep->next;
+		del_ep(ep);
+		drop_clones(ep);
+		eps[n++] = ep;
+	}
+	announce_eps(eps, n, false);
+	for (size_t i = 0; i < n; i++) {
+		close_ep(eps[i]);
+		free(eps[i]);
 	}
+	closed += n;
 
-	while (RTA_OK(rta, rtasize)) {
-		if (rta->rta_type == IFA_CACHEINFO) {
-			struct ifa_cacheinfo *cache_info = (struct ifa_cacheinfo *) RTA_DATA(rta);
-			if (cache_info->cstamp != cache_info->tstamp)
-				return false;
+	for (struct endpoint **epp = &endpoints; (ep = *epp);) {
+		if (!ep->shared || ep->members) {
+			epp = &ep->next;
+			continue;
 		}
-		rta = RTA_NEXT(rta, rtasize);
+		DEBUG(1, W, "%s: no interface left%s, closing shared socket",
+			ep->service->name, ep->ns->label);
+		*epp = ep->next;
+		del_ep(ep);
+		close_ep(ep);
+		free(ep);
 	}
 
-	return true;
+	// ... and Hello for the new ones
+	n = 0;
+	for (ep = endpoints; ep; ep = ep->next)
+		if (ep->fresh)
+			eps[n++] = ep;
+	announce_eps(eps, n, true);
+
+	for (size_t i = 0; i < n; i++) {
+		const struct service *sv = eps[i]->service;
+		if (sv->timer && sv->interval)
+			timer_set(&eps[i]->timer, sv->interval * 1000LL, sv->interval * 1000LL,
+				ep_timer, eps[i]);
+	}
+	free(eps);
+
+	DEBUG(1, W, "%s: %u endpoints opened, %u closed", __func__, opened, closed);
 }
 
-static int netlink_recv(struct endpoint *ep)
+/*
+ * Control thread. It owns the netlink sockets and the working interface
+ * tables of all namespaces, coalesces bursts of changes (-D) and
+ * publishes each outcome as a new snapshot; every loop goes on answering
+ * from the snapshot it has until then. The main loop is told over a
+ * socket pair to reconcile its endpoints against the new one, or to
+ * restart if netlink fails.
+ */
+#define RECLAIM_MS	100
+
+enum { CTL_RECONCILE, CTL_RESTART, CTL_EXIT };
+
+static int ctl_sock[2] = { -1, -1 };	/* main loop end, control thread end */
+static bool reconcile_pending;		/* run after the current event batch */
+static pthread_t ctl_thread;
+static struct timer reclaim_timer;
+
+static int ctl_recv(struct endpoint *ep);
+static int ctl_input(struct endpoint *ep, struct datagram *dg);
+
+static struct service ctl_service = {
+	.name	= "control",
+	.recv	= ctl_recv,
+	.input	= ctl_input,
+};
+
+static struct endpoint ctl_ep = {
+	.service	= &ctl_service,
+	.type	= SOCK_DGRAM,
+	.sock	= -1,
+};
+
+static void ctl_send(int fd, char op)
 {
-#define __FUNCTION__	"netlink_recv"
-	char buf[PAGE_SIZE];
-	struct sockaddr_nl sa;
-	struct iovec iov = { buf, sizeof buf };
-	struct msghdr msg = { &sa, sizeof sa, &iov, 1, NULL, 0, 0 };
-	ssize_t msglen = recvmsg(ep->sock, &msg, 0);
+	while (send(fd, &op, sizeof op, 0) < 0 && errno == EINTR)
+		;
+}
 
-	DEBUG(2, W, "%s: %zd bytes", __func__, msglen);
-	if (msglen <= 0) {
-		ep->_errno = errno;
-		ep->errstr = __FUNCTION__ ": netlink_recv: recv";
-		return -1;
-	}
-#ifdef NL_DEBUG
-	nl_debug(buf, msglen);
-#endif
-	for (struct nlmsghdr *nh = (struct nlmsghdr *) buf;
-			NLMSG_OK(nh, msglen) && nh->nlmsg_type != NLMSG_DONE;
-			nh = NLMSG_NEXT(nh, msglen)) {
-		if (is_new_addr(nh) || nh->nlmsg_type == RTM_DELADDR) {
-			DEBUG(1, W, __FUNCTION__ ": address addition/change/deletion detected.");
-			restart_service();
+static int ctl_input(struct endpoint *ep, struct datagram *dg)
+{
+	const char *op = dg->buf;
+
+	/*
+	 * Later events of the batch being dispatched may still point to the
+	 * endpoints either would close, so both wait for the main loop.
+	 */
+	(void) ep; // silent "unused" warning
+	for (size_t i = 0; i < dg->len; i++) {
+		switch (op[i]) {
+		case CTL_RECONCILE:
+			reconcile_pending = true;
+			break;
+		case CTL_RESTART:
+			DEBUG(1, W, "restarting service.");
+			restart = 1;
 			break;
 		}
 	}
-
 	return 0;
-#undef __FUNCTION__
 }
 
-static void sighandler(int sig)
+static int ctl_recv(struct endpoint *ep)
 {
-	DEBUG(0, W, "'%s' signal received.", strsignal(sig));
-	switch (sig) {
-	case SIGHUP:
-		restart = 1;
-		break;
-	default:
-		restart = 2;
-	}
+	char op;
+	struct datagram dg = { .buf = &op, .len = sizeof op };
+
+	while (recv(ep->sock, &op, sizeof op, MSG_DONTWAIT) == sizeof op)
+		ctl_input(ep, &dg);
+	return 0;
 }
 
-static char *get_smbparm(const char *name, const char *_default)
+/* Free the snapshots no loop can hold any more, retrying until none is left. */
+static void reclaim_tick(void *arg)
 {
-#define __FUNCTION__	"get_smbparm"
-	char *cmd = NULL, *result = NULL;
+	size_t left = 0;
+
+	(void) arg; // silent "unused" warning
+	for (size_t i = 0; i < nnetns; i++)
+		left += netif_reclaim(netns[i].db);
+	if (!left)
+		timer_cancel(&reclaim_timer);
+	else if (!reclaim_timer.slot)
+		timer_set(&reclaim_timer, RECLAIM_MS, RECLAIM_MS, reclaim_tick, NULL);
+}
 
-	if (asprintf(&cmd, "testparm -s --parameter-name=\"%s\" 2>/dev/null", name) <= 0) {
-		DEBUG(0, W, __FUNCTION__ ": can't allocate cmd string");
-		return NULL;
-	}
+static void publish_netifs(struct netns *ns)
+{
+	if (netif_publish(ns->db, link_usable) == 0)
+		ctl_send(ctl_sock[1], CTL_RECONCILE);
+	reclaim_tick(NULL);
+}
 
-	FILE *pp = popen(cmd, "r");
-	free(cmd);
+/*
+ * With -W -W the netlink socket filter is audited: an unfiltered twin of
+ * the socket, never polled, is drained every AUDIT_MS, and whatever it
+ * got beyond what netlink_recv() did are the wakeups the filter saved.
+ */
+#define AUDIT_MS	10000
 
-	if (!pp) {
-		DEBUG(0, W, __FUNCTION__ ": can't run testparam");
-		return strdup(_default);
+static void audit_tick(void *arg)
+{
+	struct netns *ns = arg;
+	char buf[PAGE_SIZE];
+	ssize_t n;
+
+	while ((n = recv(ns->audit_fd, buf, sizeof buf, MSG_DONTWAIT)) >= 0 ||
+			errno == EINTR || errno == ENOBUFS) {
+		if (n >= 0)
+			ns->audit_seen++;
+		else if (errno == ENOBUFS)
+			ns->audit_lost = true;
 	}
+	DEBUG(2, W, "netlink filter%s: %s%lu of %lu messages dropped in the kernel",
+		ns->label, ns->audit_lost ? "at least " : "",
+		ns->audit_seen > ns->nl_received ? ns->audit_seen - ns->nl_received : 0,
+		ns->audit_seen);
+}
 
-	char buf[PAGE_SIZE];
-	if (!fgets(buf, sizeof(buf), pp) || !buf[0]  || buf[0] == '\n') {
-		DEBUG(0, W, "cannot read %s from testparm", name);
-		result = strdup(_default);
-	} else { // trim whitespace
-		char *p;
-		for (p = buf + strlen(buf) - 1; buf < p && isspace(*p); p--)
-			*p = '\0';
-		for (p = buf; *p && isspace(*p); p++)
-			;
-		result = strdup(p);
+static void audit_start(struct netns *ns)
+{
+	struct sockaddr_nl sa = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = ns->nl_ep->service->nl_groups,
+	};
+	int rcvbuf = nl_rcvbuf_kb * 1024;
+
+	if (debug_W < 2)
+		return;
+	ns->audit_fd = ns_socket(ns, AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (ns->audit_fd < 0 || bind(ns->audit_fd, (struct sockaddr *) &sa, sizeof sa)) {
+		LOG(LOG_WARNING, "%s%s: %s", __func__, ns->label, strerror(errno));
+		if (ns->audit_fd >= 0)
+			close(ns->audit_fd);
+		ns->audit_fd = -1;
+		return;
 	}
+	setsockopt(ns->audit_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+	ns->audit_seen = ns->nl_received = 0;
+	ns->audit_lost = false;
+	timer_set(&ns->audit_timer, AUDIT_MS, AUDIT_MS, audit_tick, ns);
+}
 
-	pclose(pp);
-	return result;
-#undef __FUNCTION__
+static void audit_stop(struct netns *ns)
+{
+	if (ns->audit_fd < 0)
+		return;
+	audit_tick(ns);
+	close(ns->audit_fd);
+	ns->audit_fd = -1;
 }
 
-static void help(const char *prog, int ec, const char *fmt, ...)
+/* fds[0] is ctl_sock[1], fds[1 + i] the netlink socket of netns[i], if any. */
+static void *control_main(void *arg)
 {
-	if (fmt) {
-		va_list ap;
-		va_start(ap, fmt);
-		vprintf(fmt, ap);
-		va_end(ap);
-		puts("\n");
+	struct pollfd *fds = arg;
+
+	reclaim_tick(NULL);
+	for (size_t i = 0; i < nnetns; i++)
+		if (netns[i].nl_ep)
+			audit_start(&netns[i]);
+
+	for (;;) {
+		int n = poll(fds, nnetns + 1, timer_timeout());
+
+		if (n < 0 && errno != EINTR) {
+			LOG(LOG_WARNING, "control: poll: %s", strerror(errno));
+			ctl_send(ctl_sock[1], CTL_RESTART);
+			break;
+		}
+		if (n > 0 && fds[0].revents)
+			break; /* CTL_EXIT */
+		for (size_t i = 0; n > 0 && i < nnetns; i++) {
+			struct endpoint *ep = netns[i].nl_ep;
+
+			if (fds[1 + i].revents && ep->service->recv(ep) < 0) {
+				DEBUG(1, W, "Detected %s socket error%s, restarting: %s",
+					ep->service->name, netns[i].label, strerror(ep->_errno));
+				ctl_send(ctl_sock[1], CTL_RESTART);
+				goto out;
+			}
+		}
+		timer_run();
 	}
-	printf( "WSDD and LLMNR daemon\n"
-		"Usage: %s [options]\n"
-		"       -h this message\n"
-		"       -d become daemon\n"
-		"       -4 IPv4 only\n"
-		"       -6 IPv6 only\n"
-		"       -u UDP only\n"
-		"       -t TCP only\n"
-		"       -l LLMNR only\n"
-		"       -w WSDD only\n"
-		"       -L increment LLMNR debug level (%d)\n"
-		"       -W increment WSDD debug level (%d)\n"
-		"       -i <interface> reply only on this interface (%s)\n"
-		"       -H <name> set host name (%s)\n"
-		"       -A \"name list\" set host aliases (%s)\n"
-		"       -N <name> set netbios name (%s)\n"
-		"       -B \"name list\" set netbios aliases (%s)\n"
-		"       -G <name> set workgroup (%s)\n"
-		"       -b \"key1:val1,key2:val2,...\" boot parameters:\n",
-		prog, debug_L, debug_W, ifname ? ifname : "any",
-		hostname, hostaliases, netbiosname, netbiosaliases, workgroup
-	);
-	printBootInfoKeys(stdout, 11);
-	exit(ec);
+
+out:
+	for (size_t i = 0; i < nnetns; i++)
+		audit_stop(&netns[i]);
+	timer_free();
+	free(fds);
+	DEBUG(1, W, "control: %lu netlink overflows", nl_overflows);
+	return NULL;
 }
 
-static void init_sysinfo()
+/*
+ * Load and publish the interface table of each namespace, then hand the
+ * netlink endpoints, opened beforehand so that no change is missed, to
+ * the control thread.
+ */
+static void start_control(void)
 {
-	char hostn[HOST_NAME_MAX + 1];
+	struct pollfd *fds;
+	sigset_t all, old;
+	size_t nl = 0;
 
-	if (!hostname && gethostname(hostn, sizeof(hostn) - 1) != 0)
-		err(EXIT_FAILURE, "gethostname");
+	if (!(fds = (struct pollfd *) calloc(nnetns + 1, sizeof(*fds))))
+		err(EXIT_FAILURE, "start_control: calloc");
 
-	char *p = strchr(hostn, '.');
-	if (p) *p = '\0';
-	hostname = strdup(hostn);
+	for (size_t i = 0; i < nnetns; i++) {
+		struct netns *ns = &netns[i];
 
-	if (!hostaliases && !(hostaliases = get_smbparm("additional dns hostnames", "")))
-		err(EXIT_FAILURE, "get_smbparm");
+		fds[1 + i].fd = -1;
+		if (!ns->nl_ep)
+			continue;
+		ns->dump_fd = ns_socket(ns, AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+		if (ns->dump_fd < 0 || netif_load(ns->db, ns->dump_fd))
+			err(EXIT_FAILURE, "netif_load()%s", ns->label);
+		if (netif_publish(ns->db, link_usable))
+			err(EXIT_FAILURE, "netif_publish()");
+		if (netif_filter(ns->nl_ep->sock))
+			LOG(LOG_WARNING, "%s%s: SO_ATTACH_FILTER: %s", ns->nl_ep->service->name,
+				ns->label, strerror(errno));
+		fds[1 + i].fd = ns->nl_ep->sock;
+		fds[1 + i].events = POLLIN;
+		nl++;
+	}
+	if (!nl) {
+		free(fds);
+		return;
+	}
 
-	if (!netbiosname && !(netbiosname = get_smbparm("netbios name", hostname)))
-		err(EXIT_FAILURE, "get_smbparm");
+	if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, ctl_sock))
+		err(EXIT_FAILURE, "start_control: socketpair");
+	ctl_ep.sock = ctl_sock[0];
+	if (poll_ep(&ctl_ep))
+		err(EXIT_FAILURE, "start_control: %s", ctl_ep.errstr);
+	fds[0].fd = ctl_sock[1];
+	fds[0].events = POLLIN;
+
+	/* Signals are for the main loop. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	errno = pthread_create(&ctl_thread, NULL, control_main, fds);
+	if (errno)
+		err(EXIT_FAILURE, "start_control: pthread_create");
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
 
-	if (!netbiosaliases && !(netbiosaliases = get_smbparm("netbios aliases", "")))
-		err(EXIT_FAILURE, "get_smbparm");
+static void stop_control(void)
+{
+	if (ctl_sock[0] >= 0) {
+		ctl_send(ctl_sock[0], CTL_EXIT);
+		pthread_join(ctl_thread, NULL);
+		del_ep(&ctl_ep);
+		close(ctl_sock[0]);
+		close(ctl_sock[1]);
+		ctl_ep.sock = ctl_sock[0] = ctl_sock[1] = -1;
+	}
 
-	if (!workgroup && !(workgroup = get_smbparm("workgroup", "WORKGROUP")))
-		err(EXIT_FAILURE, "get_smbparm");
+	for (size_t i = 0; i < nnetns; i++) {
+		struct netns *ns = &netns[i];
 
-	init_getresp();
+		if (!ns->nl_ep)
+			continue;
+		close(ns->nl_ep->sock);
+		free(ns->nl_ep);
+		ns->nl_ep = NULL;
+	}
 }
 
-#define	_4	1
-#define	_6	2
-#define _TCP	1
-#define _UDP	2
-#define	_LLMNR	1
-#define	_WSDD	2
-
 int main(int argc, char **argv)
 {
 	int opt;
 	const char *prog = basename(argv[0]);
-	unsigned int ipv46 = 0, tcpudp = 0, llmnrwsdd = 0;
+	long long started = mono_ms();
 
 	init_sysinfo();
 
-	while ((opt = getopt(argc, argv, "hd46utlwLWi:H:N:G:b:")) != -1) {
+	while ((opt = getopt(argc, argv, "hd46utlwLWsci:x:n:j:D:R:H:N:G:P:b:")) != -1) {
 		switch (opt) {
 		case 'h':
 			help(prog, EXIT_SUCCESS, NULL);
@@ -725,17 +2982,58 @@ int main(int argc, char **argv)
 		case 'W':
 			debug_W++;
 			break;
+		case 's':
+			shared_mcast = true;
+			break;
+		case 'c':
+			steer_cpu = true;
+			break;
+		case 'j':
+			if (!optarg || !isdigit(*optarg) || !(nloops = strtoul(optarg, NULL, 10)))
+				help(prog, EXIT_FAILURE, "Bad number of event loops '%s'", optarg);
+#ifdef USE_IO_URING
+			if (nloops > 1)
+				help(prog, EXIT_FAILURE, "-j needs the epoll event loop");
+#endif
+			break;
 		case 'i':
 			if (optarg && strlen(optarg) && strcmp(optarg, "any") != 0) {
-				ifname = strdup(optarg);
-				ifindex = ifname ? if_nametoindex(ifname) : 0;
-				if (!ifindex) help(prog, EXIT_FAILURE, "Bad interface '%s'", ifname);
+				if (netif_match_add(&include_ifs, optarg))
+					err(EXIT_FAILURE, "netif_match_add");
 			} else {
-				free(ifname);
-				ifname = NULL;
-				ifindex = 0;
+				netif_match_free(&include_ifs);
 			}
 			break;
+		case 'x':
+			if (optarg && strlen(optarg) && netif_match_add(&exclude_ifs, optarg))
+				err(EXIT_FAILURE, "netif_match_add");
+			break;
+		case 'n': {
+			char *list = optarg ? strdup(optarg) : NULL, *save = NULL;
+
+			for (char *p = list ? strtok_r(list, ",", &save) : NULL; p;
+					p = strtok_r(NULL, ",", &save)) {
+				const char **names = realloc(netns_names,
+						(nnetns_names + 1) * sizeof(*names));
+				if (!names)
+					err(EXIT_FAILURE, "realloc");
+				netns_names = names;
+				netns_names[nnetns_names++] = p;
+			}
+			if (!nnetns_names)
+				help(prog, EXIT_FAILURE, "Bad network namespace '%s'", optarg);
+			break;
+		}
+		case 'D':
+			if (!optarg || !isdigit(*optarg))
+				help(prog, EXIT_FAILURE, "Bad quiet period '%s'", optarg);
+			coalesce_ms = strtoul(optarg, NULL, 10);
+			break;
+		case 'R':
+			if (!optarg || !isdigit(*optarg) || !(nl_rcvbuf_kb = strtoul(optarg, NULL, 10)) ||
+				nl_rcvbuf_kb > INT_MAX / 1024)
+				help(prog, EXIT_FAILURE, "Bad netlink receive buffer size '%s'", optarg);
+			break;
 		case 'H':
 			if (optarg != NULL && strlen(optarg) > 0)
 				hostname = strdup(optarg);
@@ -748,13 +3046,17 @@ int main(int argc, char **argv)
 			if (optarg != NULL && strlen(optarg) > 0)
 				workgroup = strdup(optarg);
 			break;
+		case 'P':
+			if (!optarg || add_profile(optarg))
+				help(prog, EXIT_FAILURE, "Bad profile '%s'", optarg);
+			break;
 		case 'b':
 			while (optarg)
 				if (set_getresp(optarg, (const char **)&optarg) != 0)
 					help(prog, EXIT_FAILURE, "Bad key:val '%s'", optarg);
 			break;
 		case '?':
-			if (strchr("iHNGb", optopt))
+			if (strchr("ixnjDRHNGPb", optopt))
 				printf("Option -%c requires an argument.\n", optopt);
 			/* ... fall through ... */
 		default:
@@ -765,6 +3067,15 @@ int main(int argc, char **argv)
 	if (argc > optind)
 		help(prog, EXIT_FAILURE, "Unknown argument '%s'", argv[optind]);
 
+	if (include_ifs.npat == 1 && include_ifs.pat[0].kind == NETIF_EXACT) {
+		ifname = include_ifs.pat[0].glob;
+		/* Other namespaces are only looked into once they are open. */
+		if (!nnetns_names && !if_nametoindex(ifname))
+			help(prog, EXIT_FAILURE, "Bad interface '%s'", ifname);
+	}
+	if (netif_match_add(&default_excludes, DEFAULT_EXCLUDES))
+		err(EXIT_FAILURE, "netif_match_add");
+
 	if (!ipv46)
 		ipv46 = _4 | _6;
 	if (!llmnrwsdd)
@@ -796,11 +3107,21 @@ int main(int argc, char **argv)
 
 	openlog(prog, LOG_PID, LOG_USER);
 	LOG(LOG_INFO, "starting.");
+	DEBUG(1, W, "smb.conf parameters read in %lld ms", smbconf_ms);
+	listen_fds_init();
+	init_identities();
+
+#ifndef USE_IO_URING
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		err(EXIT_FAILURE, "epoll_create1");
+#endif
 
 again:
 	{} /* Necessary to satisfy C syntax for statement labeling. */
 	struct sigaction sigact, oldact;
-	DEBUG(1, W, "ifname %s, ifindex %d", ifname, ifindex);
+	reconcile_pending = false;
+	netns_open();
+	DEBUG(1, W, "ifname %s, %zu network namespaces", ifname, nnetns);
 	DEBUG(1, W, "hostname %s, netbios name %s, workgroup %s", hostname, netbiosname, workgroup);
 
 	sigemptyset(&sigact.sa_mask);
@@ -813,141 +3134,46 @@ again:
 		err(EXIT_FAILURE, "cannot install signal handler.");
 	}
 
-	// Refresh ifaddrs list
-	if (ifaddrs_list != NULL)
-		freeifaddrs(ifaddrs_list);
-	if (getifaddrs(&ifaddrs_list) != 0)
-		err(EXIT_FAILURE, "getifaddrs()");
+#ifdef USE_IO_URING
+	if (uring_init())
+		err(EXIT_FAILURE, "io_uring");
+#endif
 
-	fd_set fds;
-	int rv = 0, nfds = -1;
+	int rv = 0;
 	struct endpoint *ep, *badep = NULL;
 
-	FD_ZERO(&fds);
+	for (size_t i = 0; i < nnetns && !badep; i++) {
+		struct netns *ns = &netns[i];
 
-	for (size_t svn = 0; svn < ARRAY_SIZE(services); svn++) {
-		struct service *sv = &services[svn];
-
-		if (!(ipv46 & _4) && sv->family == AF_INET)
-			continue;
-		if (!(ipv46 & _6) && sv->family == AF_INET6)
-			continue;
-		if (!(tcpudp & _TCP) && sv->type == SOCK_STREAM)
-			continue;
-		if (!(tcpudp & _UDP) && sv->type == SOCK_DGRAM)
-			continue;
-		if (!(llmnrwsdd & _LLMNR) && strstr(sv->name, "llmnr"))
-			continue;
-		if (!(llmnrwsdd & _WSDD) && strstr(sv->name, "wsdd"))
-			continue;
-
-		if (sv->family == AF_INET || sv->family == AF_INET6) {
-			for (struct ifaddrs *ifa = ifaddrs_list; ifa; ifa = ifa->ifa_next) {
-				if (ifa->ifa_flags & IFF_SLAVE || !ifa->ifa_netmask ||
-					!ifa->ifa_addr || ifa->ifa_addr->sa_family != sv->family)
-					continue;
-
-				char ifaddr[_ADDRSTRLEN];
-				void *addr = _SIN_ADDR((_saddr_t *)ifa->ifa_addr);
-				inet_ntop(ifa->ifa_addr->sa_family, addr, ifaddr, sizeof(ifaddr));
-
-				if (ifname && strcmp(ifa->ifa_name, ifname) != 0) {
-					//DEBUG(2, W, "skipped %s: not selected", ifa->ifa_name);
-					ifa->ifa_flags |= IFF_SLAVE; // mark as not used
-					continue;
-				}
+		for (size_t svn = 0; svn < ARRAY_SIZE(services); svn++) {
+			struct service *sv = &services[svn];
 
-				// skip if already bound to this interface
-				ep = NULL;
-				for (struct endpoint *e = endpoints; e; e = e->next)
-					if (e->service == sv && strcmp(e->ifname, ifa->ifa_name) == 0)
-						ep = e;
-
-				// show interface
-				DEBUG(1, W, "%s %s port %d %s %s @ %s%s", sv->name,
-					socktype_str[sv->type], sv->port_num,
-					sv->mcast_addr ? sv->mcast_addr : "-",
-					ifaddr, ifa->ifa_name, ep ? ": already bound" : "");
-				if (ep)
-					continue;
-
-				if (!ifname && sv->mcast_addr && !(ifa->ifa_flags & IFF_MULTICAST)) {
-					DEBUG(2, W, "skipped %s: not multicast", ifa->ifa_name);
-					ifa->ifa_flags |= IFF_SLAVE; // mark as not used
-					continue;
-				}
-				if (!ifname && (ifa->ifa_flags & IFF_LOOPBACK)) {
-					DEBUG(2, W, "skipped %s: loopback", ifa->ifa_name);
-					ifa->ifa_flags |= IFF_SLAVE; // mark as not used
-					continue;
-				}
-				if (!ifname && ((!strcmp(ifa->ifa_name, "LeafNets")) ||
-						(!strncmp(ifa->ifa_name, "docker", 6)) ||
-						(!strncmp(ifa->ifa_name, "veth", 4)) ||
-						(!strncmp(ifa->ifa_name, "tun", 3)) ||
-						(!strncmp(ifa->ifa_name, "ppp", 3)) ||
-						(!strncmp(ifa->ifa_name, "zt", 2)))) {
-					DEBUG(2, W, "skipped %s: excluded by name", ifa->ifa_name);
-					ifa->ifa_flags |= IFF_SLAVE; // mark as not used
-					continue;
-				}
-				// skip bridge ports unless it is specified on the command line
-				if (!ifname) {
-					struct stat st;
-					char path[sizeof("/sys/class/net//brport") + IFNAMSIZ];
-					snprintf(path, sizeof(path), "/sys/class/net/%s/brport", ifa->ifa_name);
-					if (stat(path, &st) == 0) {
-						DEBUG(2, W, "skipped %s: bridge port", ifa->ifa_name);
-						ifa->ifa_flags |= IFF_SLAVE; // mark as not used
-						continue;
-					}
-				}
-				// open socket for this interface/family
-				if (open_ep(&ep, sv, ifa) != 0) {
-					LOG(LOG_ERR, "error: %s: %s: %s", ep->service->name,
-						ep->errstr, strerror(ep->_errno));
-					ifa->ifa_flags |= IFF_SLAVE; // mark as not used
-					free(ep);
-					continue;
-				} else if (ep->sock < 0) {
-					free(ep);
-				} else {
-					ep->next = endpoints;
-					endpoints = ep;
-					FD_SET(ep->sock, &fds);
-					if (nfds < ep->sock)
-						nfds = ep->sock;
-				}
-			}
+			if (sv->family != AF_NETLINK || !service_enabled(sv))
+				continue;
 
-		} else if (sv->family == AF_NETLINK) {
-			struct ifaddrs ifa = {};
-			ifa.ifa_name = "netlink";
+			const struct netif ifp = { .name = "netlink" };
 
-			DEBUG(2, W, "%s 0x%x @ %s", sv->name, sv->nl_groups, ifa.ifa_name);
-			if (open_ep(&ep, sv, &ifa) != 0) {
+			DEBUG(2, W, "%s 0x%x @ %s%s", sv->name, sv->nl_groups, ifp.name, ns->label);
+			if (open_ep(&ep, ns, sv, &ifp, NULL, NULL) != 0) {
 				badep = ep;
 				break;
 			} else if (ep->sock < 0) {
 				free(ep);
 			} else {
-				ep->next = endpoints;
-				endpoints = ep;
-				FD_SET(ep->sock, &fds);
-				if (nfds < ep->sock)
-					nfds = ep->sock;
+				ns->nl_ep = ep;
 			}
 		}
 	}
 
 	if (!badep) {
-		for (struct endpoint *ep = endpoints; ep; ep = ep->next) {
-			if (ep->service->init && ep->service->init(ep)) {
-				DEBUG(1, W, "%s init failed: %s: %s", ep->service->name,
-						ep->errstr, strerror(ep->_errno));
-				//badep = ep;
-			}
-		}
+		start_control();
+		start_workers();
+		adopt_listeners();
+		netif_online();
+		reconcile_eps();
+		/* Hello is out on every interface by now. */
+		DEBUG(1, W, "ready in %lld ms", mono_ms() - started);
+		notify_systemd("READY=1");
 	}
 
 	if (!badep) {
@@ -957,27 +3183,30 @@ again:
 			goto end;
 
 		do {
-			fd_set rfds = fds;
-			n = select(nfds + 1, &rfds, NULL, NULL, NULL);
-			DEBUG(4, W, "select: n=%d", n);
-			for (ep = endpoints; n > 0 && ep; ep = ep->next) {
-				if (!FD_ISSET(ep->sock, &rfds))
-					continue;
-				DEBUG(3, W, "dispatch %s recv", ep->service->name);
-				n--;
-				if (ep->service->recv) {
-					int ret = ep->service->recv(ep);
-					if (ret < 0) {
-						DEBUG(1, W, "Detected %s socket error, restarting",
-							ep->service->name);
-						restart_service();
-					}
-				}
+#ifdef USE_IO_URING
+			netif_offline();
+			n = uring_wait(timer_timeout());
+#else
+			struct epoll_event events[EPOLL_MAX_EVENTS];
+			netif_offline();
+			n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), timer_timeout());
+			netif_online();
+			DEBUG(4, W, "epoll_wait: n=%d", n);
+			if (n < 0 && errno == EINTR)
+				n = 0; /* stopped and resumed, or a signal handled */
+			for (int i = 0; i < n; i++)
+				dispatch_ep((struct endpoint *) events[i].data.ptr);
+#endif
+			if (reconcile_pending && !restart) {
+				reconcile_pending = false;
+				reconcile_eps();
 			}
+			if (n >= 0)
+				timer_run();
 		} while (n >= 0 && !restart);
 
-		if (n < 0 && errno != EINTR) {
-			LOG(LOG_WARNING, "%s: select: %s", __func__, strerror(errno));
+		if (n < 0) {
+			LOG(LOG_WARNING, "%s: event wait: %s", __func__, strerror(errno));
 			rv = EXIT_FAILURE;
 		}
 	}
@@ -993,12 +3222,40 @@ end:
 		baderrno = badep->_errno;
 	}
 
+	netif_offline();
+	stop_control();
+	stop_workers();
+	/* Listeners from systemd stay open across a restart, but not polled. */
+	for (ep = endpoints; ep; ep = ep->next)
+		if (ep->activated)
+			del_ep(ep);
+#ifdef USE_IO_URING
+	uring_exit();
+#endif
+	batch_stats(1);
+
+	close_conns();
+	sendq_drop(NULL);
+	timer_free();
+
+	size_t n = 0;
+	for (ep = endpoints; ep; ep = ep->next)
+		n++;
+	struct endpoint **eps = ep_array(n);
+	n = 0;
+	for (ep = endpoints; ep; ep = ep->next)
+		if (!ep->shared)
+			eps[n++] = ep;
+	announce_eps(eps, n, false);
+	free(eps);
+
 	while (endpoints) {
 		struct endpoint *tempep = endpoints->next;
 		close_ep(endpoints);
 		free(endpoints);
 		endpoints = tempep;
 	}
+	netns_close();
 
 	if (badep) {
 		LOG(LOG_ERR, "%s: %s: terminating.", badservice, badbad);
@@ -1009,13 +3266,18 @@ end:
 
 	if (restart == 1) {
 		restart = 0;
+		started = mono_ms();
 		goto again;
 	}
 
-	if (ifaddrs_list != NULL) {
-		freeifaddrs(ifaddrs_list);
-		ifaddrs_list = NULL;
-	}
+	free(netns_names);
+	netif_match_free(&include_ifs);
+	netif_match_free(&exclude_ifs);
+	netif_match_free(&default_excludes);
+
+#ifndef USE_IO_URING
+	close(epoll_fd);
+#endif
 
 	LOG(LOG_INFO, "terminating.");
 	closelog();